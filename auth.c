@@ -0,0 +1,325 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __OpenBSD__
+#include <bsd_auth.h>
+#include <strings.h> /* explicit_bzero(3) */
+#else
+#include <security/pam_appl.h>
+#endif
+#include <ev.h>
+
+#include "i3lock.h"
+#include "auth.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* How many attempts can be in progress at once, including the ones queued
+ * behind an attempt which hangs in the authentication backend. */
+#define MAX_AUTH_ATTEMPTS 4
+
+/* The PAM service given by --pam-service, or NULL for "i3lock". */
+char *pam_service = NULL;
+
+extern bool debug_mode;
+
+typedef struct {
+    /* Whether a worker is verifying this attempt, or its result was not
+     * handled yet. */
+    bool busy;
+    bool done;
+    bool success;
+    /* Whether the attempt waits for the worker to pick it up. */
+    bool queued;
+    /* Whether the attempt was given up on, see auth_abandon(). */
+    bool abandoned;
+    uint64_t started_us;
+    /* A copy of the password, so that the user can keep typing meanwhile. */
+    char password[512];
+} auth_attempt_t;
+
+static auth_attempt_t attempts[MAX_AUTH_ATTEMPTS];
+static auth_attempt_t *current_attempt;
+static pthread_mutex_t attempts_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when an attempt is queued. */
+static pthread_cond_t attempts_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *auth_username;
+static auth_result_cb_t result_cb;
+
+/* Attempts are only verified in the worker thread once the event loop runs
+ * and i3lock has forked, see start_auth_workers(). */
+static bool workers_running;
+static struct ev_loop *auth_loop;
+static ev_async auth_done;
+
+#ifndef __OpenBSD__
+/*
+ * Callback function for PAM. We only react on password request callbacks.
+ *
+ */
+static int conv_callback(int num_msg, const struct pam_message **msg,
+                         struct pam_response **resp, void *appdata_ptr) {
+    const auth_attempt_t *attempt = appdata_ptr;
+
+    if (num_msg == 0)
+        return 1;
+
+    /* PAM expects an array of responses, one for each message */
+    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int c = 0; c < num_msg; c++) {
+        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        /* return code is currently not used but should be set to zero */
+        (*resp)[c].resp_retcode = 0;
+        if (((*resp)[c].resp = strdup(attempt->password)) == NULL) {
+            perror("strdup");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+static void clear_attempt_password(auth_attempt_t *attempt) {
+#ifdef __OpenBSD__
+    explicit_bzero(attempt->password, sizeof(attempt->password));
+#else
+    /* A volatile pointer, so that the compiler does not optimize this out,
+     * see clear_password_memory(). */
+    volatile char *vpassword = attempt->password;
+    for (size_t c = 0; c < sizeof(attempt->password); c++)
+        vpassword[c] = 0;
+#endif
+}
+
+/*
+ * Verifies the password of the given attempt. Only ever called by one thread
+ * at a time (the worker, or the main thread before the worker runs), as PAM
+ * modules are not required to be thread-safe.
+ *
+ */
+static bool authenticate(auth_attempt_t *attempt) {
+    trace_span_t span = trace_begin("pam_authenticate");
+#ifdef __OpenBSD__
+    const bool success = (auth_userokay((char *)auth_username, NULL, NULL, attempt->password) != 0);
+#else
+    pam_handle_t *pam_handle;
+    struct pam_conv conv = {conv_callback, attempt};
+    int ret = pam_start(pam_service != NULL ? pam_service : "i3lock", auth_username, &conv, &pam_handle);
+    if (ret == PAM_SUCCESS)
+        ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"));
+    if (ret == PAM_SUCCESS)
+        ret = pam_authenticate(pam_handle, 0);
+    const bool success = (ret == PAM_SUCCESS);
+    if (success) {
+        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
+         * Related to credentials pam_end() needs to be called to cleanup any temporary
+         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
+         * refresh of the credentials failed. */
+        pam_setcred(pam_handle, PAM_REFRESH_CRED);
+    }
+    pam_end(pam_handle, ret);
+#endif
+    trace_end(span);
+    metrics_observe_since(HISTOGRAM_AUTH_SECONDS, attempt->started_us);
+    clear_attempt_password(attempt);
+    return success;
+}
+
+/*
+ * Verifies the queued attempts one after the other, oldest first. An attempt
+ * queued behind one which hangs in the authentication backend waits until
+ * that one returns.
+ *
+ */
+static void *auth_thread_main(void *arg) {
+    pthread_mutex_lock(&attempts_mutex);
+    while (true) {
+        auth_attempt_t *attempt = NULL;
+        for (int i = 0; i < MAX_AUTH_ATTEMPTS; i++)
+            if (attempts[i].queued &&
+                (attempt == NULL || attempts[i].started_us < attempt->started_us))
+                attempt = &attempts[i];
+        if (attempt == NULL) {
+            pthread_cond_wait(&attempts_cond, &attempts_mutex);
+            continue;
+        }
+        attempt->queued = false;
+        pthread_mutex_unlock(&attempts_mutex);
+
+        const bool success = authenticate(attempt);
+
+        pthread_mutex_lock(&attempts_mutex);
+        attempt->success = success;
+        attempt->done = true;
+        ev_async_send(auth_loop, &auth_done);
+    }
+    return NULL;
+}
+
+/*
+ * Handles the results of all attempts which finished. Failures of abandoned
+ * attempts are dropped, the user was already told about them.
+ *
+ */
+static void auth_done_cb(EV_P_ ev_async *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_AUTH);
+    for (int i = 0; i < MAX_AUTH_ATTEMPTS; i++) {
+        auth_attempt_t *attempt = &attempts[i];
+
+        pthread_mutex_lock(&attempts_mutex);
+        const bool done = attempt->busy && attempt->done;
+        const bool success = attempt->success;
+        const bool abandoned = attempt->abandoned;
+        if (done) {
+            attempt->busy = false;
+            if (attempt == current_attempt)
+                current_attempt = NULL;
+        }
+        pthread_mutex_unlock(&attempts_mutex);
+
+        if (!done)
+            continue;
+        DEBUG("authentication attempt %d finished: %s%s\n", i,
+              success ? "success" : "failure", abandoned ? " (abandoned)" : "");
+        if (success || !abandoned)
+            result_cb(success);
+    }
+}
+
+/*
+ * Checks that the PAM service can be used, and locks the copies of the
+ * password in memory (see the mlock() of the password in main()).
+ *
+ */
+void auth_init(const char *username, auth_result_cb_t callback) {
+    auth_username = username;
+    result_cb = callback;
+
+#ifndef __OpenBSD__
+    pam_handle_t *pam_handle;
+    struct pam_conv conv = {conv_callback, NULL};
+    int ret;
+    if ((ret = pam_start(pam_service != NULL ? pam_service : "i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+    pam_end(pam_handle, ret);
+#endif
+
+#if defined(__linux__)
+    if (mlock(attempts, sizeof(attempts)) != 0)
+        err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
+#endif
+}
+
+/*
+ * Verifies passwords in a worker thread from now on, so that the event loop
+ * keeps running while the authentication backend is busy. Must be called
+ * after forking, like start_render_thread().
+ *
+ */
+void start_auth_workers(struct ev_loop *loop) {
+    static bool started = false;
+    if (started)
+        return;
+    started = true;
+
+    auth_loop = loop;
+    ev_async_init(&auth_done, auth_done_cb);
+    ev_async_start(loop, &auth_done);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, auth_thread_main, NULL) == 0)
+        workers_running = true;
+    else
+        warnx("Could not start the authentication thread, verifying passwords in the main thread");
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Starts verifying the given password. Returns false if too many attempts
+ * are still in progress.
+ *
+ */
+bool auth_start(const char *password) {
+    auth_attempt_t *attempt = NULL;
+
+    pthread_mutex_lock(&attempts_mutex);
+    for (int i = 0; i < MAX_AUTH_ATTEMPTS && attempt == NULL; i++)
+        if (!attempts[i].busy)
+            attempt = &attempts[i];
+    if (attempt != NULL) {
+        attempt->busy = true;
+        attempt->done = false;
+        attempt->queued = workers_running;
+        attempt->abandoned = false;
+        attempt->started_us = monotonic_us();
+        snprintf(attempt->password, sizeof(attempt->password), "%s", password);
+        current_attempt = attempt;
+        if (workers_running)
+            pthread_cond_signal(&attempts_cond);
+    }
+    pthread_mutex_unlock(&attempts_mutex);
+
+    if (attempt == NULL)
+        return false;
+    if (workers_running)
+        return true;
+
+    /* Before forking (or without threads), block as i3lock always did. */
+    const bool success = authenticate(attempt);
+    attempt->busy = false;
+    current_attempt = NULL;
+    result_cb(success);
+    return true;
+}
+
+/*
+ * Whether the attempt started last is still being verified.
+ *
+ */
+bool auth_in_progress(void) {
+    pthread_mutex_lock(&attempts_mutex);
+    const bool in_progress = (current_attempt != NULL);
+    pthread_mutex_unlock(&attempts_mutex);
+    return in_progress;
+}
+
+/*
+ * Gives up on the attempt started last: it is still verified (PAM cannot be
+ * interrupted, and the next attempt waits for it), but its failure will not
+ * be reported. A late success still unlocks, as the password was right.
+ *
+ */
+void auth_abandon(void) {
+    pthread_mutex_lock(&attempts_mutex);
+    if (current_attempt != NULL) {
+        current_attempt->abandoned = true;
+        current_attempt = NULL;
+    }
+    pthread_mutex_unlock(&attempts_mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef _AUTH_H
+#define _AUTH_H
+
+#include <stdbool.h>
+
+struct ev_loop;
+
+/* Called with the result of an authentication attempt: of the current one,
+ * or the success of an abandoned one (see auth_abandon()). */
+typedef void (*auth_result_cb_t)(bool success);
+
+/* The PAM service given by --pam-service, or NULL for "i3lock". */
+extern char *pam_service;
+
+void auth_init(const char *username, auth_result_cb_t callback);
+void start_auth_workers(struct ev_loop *loop);
+bool auth_start(const char *password);
+bool auth_in_progress(void);
+void auth_abandon(void);
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ * Counts heap allocations, to verify that i3lock does not allocate while
+ * handling events. Build it and preload it into i3lock:
+ *
+ *   cc -shared -fPIC -O2 -o alloc-count.so bench/alloc-count.c
+ *   I3LOCK_PRELOAD=$PWD/alloc-count.so bench/key-stress
+ *
+ * With --replay, i3lock then prints the allocations made while replaying,
+ * per replayed event (see replay.c). All threads and libraries (cairo, xcb,
+ * …) are counted. Only works with glibc, whose allocator is called through
+ * its __libc_* entry points.
+ *
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t allocations;
+
+static void count(void) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the number of allocations so far. Looked up by i3lock with
+ * dlsym().
+ *
+ */
+uint64_t i3lock_allocations(void) {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    count();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    count();
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
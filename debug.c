@@ -0,0 +1,230 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "debug.h"
+#include "metrics.h"
+
+/* The number of records kept, and the maximum length of each. Longer
+ * messages are truncated. */
+#define DEBUG_RECORDS 1024
+#define DEBUG_RECORD_SIZE 240
+
+/* Path given by --debug-ring, or NULL. */
+char *debug_ring_path = NULL;
+
+extern bool debug_mode;
+
+typedef struct {
+    uint64_t time_us;
+    char text[DEBUG_RECORD_SIZE];
+} debug_record_t;
+
+/* The ring buffer. Records are numbered consecutively, record n lives in
+ * records[n % DEBUG_RECORDS]. It is written to from the event loop as well
+ * as from the render threads. */
+static debug_record_t records[DEBUG_RECORDS];
+static uint64_t next_record;
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether records are printed to stdout (--debug), and the number of the
+ * first record not printed yet. */
+static bool debug_stdout;
+static uint64_t next_printed;
+static uint64_t records_lost;
+
+/* Whether every record is printed right away, see
+ * debug_flush_synchronously(). */
+static bool flush_synchronously;
+
+static uint64_t start_us;
+
+static struct ev_prepare flush_watcher;
+static struct ev_signal dump_watcher;
+
+/*
+ * Adds a message to the ring buffer, see DEBUG(). Only the message itself is
+ * formatted here, as its arguments might not live long enough; the
+ * timestamp is formatted and everything is written out later, outside of the
+ * input and rendering paths (see debug_flush() and debug_dump()).
+ *
+ */
+void debug_log(const char *fmt, ...) {
+    const uint64_t now = monotonic_us();
+
+    pthread_mutex_lock(&records_mutex);
+    if (debug_stdout && next_record - next_printed == DEBUG_RECORDS) {
+        /* Not printed yet, but overwritten now. */
+        next_printed++;
+        records_lost++;
+    }
+    debug_record_t *record = &records[next_record++ % DEBUG_RECORDS];
+    record->time_us = now;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(record->text, sizeof(record->text), fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof(record->text))
+        /* Keep the newline of truncated messages. */
+        record->text[sizeof(record->text) - 2] = '\n';
+    pthread_mutex_unlock(&records_mutex);
+
+    if (flush_synchronously)
+        debug_flush();
+}
+
+/*
+ * Copies record n out of the ring buffer. Returns false if it was already
+ * overwritten.
+ *
+ */
+static bool copy_record(uint64_t n, debug_record_t *dest) {
+    pthread_mutex_lock(&records_mutex);
+    const bool valid = (next_record - n <= DEBUG_RECORDS && n < next_record);
+    if (valid)
+        *dest = records[n % DEBUG_RECORDS];
+    pthread_mutex_unlock(&records_mutex);
+    return valid;
+}
+
+static void format_record(FILE *stream, const debug_record_t *record) {
+    const uint64_t since_start = (record->time_us > start_us ? record->time_us - start_us : 0);
+    fprintf(stream, "[i3lock-debug] [%5llu.%06llu] %s",
+            (unsigned long long)(since_start / 1000000),
+            (unsigned long long)(since_start % 1000000), record->text);
+}
+
+/*
+ * Prints the records added since the last call to stdout, when started with
+ * --debug. Called before the event loop blocks, so that debug output does
+ * not delay handling key presses or drawing.
+ *
+ */
+void debug_flush(void) {
+    if (!debug_stdout)
+        return;
+
+    debug_record_t record;
+    for (;;) {
+        pthread_mutex_lock(&records_mutex);
+        const uint64_t lost = records_lost;
+        records_lost = 0;
+        const bool done = (next_printed == next_record);
+        if (!done)
+            record = records[next_printed++ % DEBUG_RECORDS];
+        pthread_mutex_unlock(&records_mutex);
+
+        if (lost > 0)
+            printf("[i3lock-debug] %llu debug messages lost\n", (unsigned long long)lost);
+        if (done)
+            break;
+        format_record(stdout, &record);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Prints every record to stdout as soon as it is added, for processes
+ * without an event loop (the raise_loop() child), which would otherwise
+ * exit without printing anything.
+ *
+ */
+void debug_flush_synchronously(void) {
+    flush_synchronously = true;
+    debug_flush();
+}
+
+/*
+ * Appends the whole ring buffer to the file given by --debug-ring.
+ *
+ */
+void debug_dump(const char *reason) {
+    if (debug_ring_path == NULL)
+        return;
+
+    int fd = open(debug_ring_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    FILE *f = (fd == -1 ? NULL : fdopen(fd, "a"));
+    if (f == NULL) {
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    fprintf(f, "[i3lock-debug] dump of the last %d messages of pid %d (%s), at %ld\n",
+            DEBUG_RECORDS, getpid(), reason, (long)time(NULL));
+    pthread_mutex_lock(&records_mutex);
+    const uint64_t end = next_record;
+    pthread_mutex_unlock(&records_mutex);
+    const uint64_t first = (end > DEBUG_RECORDS ? end - DEBUG_RECORDS : 0);
+
+    debug_record_t record;
+    for (uint64_t n = first; n < end; n++)
+        if (copy_record(n, &record))
+            format_record(f, &record);
+    fclose(f);
+}
+
+static void debug_exit(void) {
+    debug_flush();
+    debug_dump("exit");
+}
+
+static void flush_cb(EV_P_ ev_prepare *w, int revents) {
+    debug_flush();
+}
+
+static void dump_cb(EV_P_ ev_signal *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_SIGNAL);
+    debug_dump("SIGUSR1");
+}
+
+/*
+ * Enables the ring buffer if either --debug or --debug-ring was given. With
+ * --debug-ring alone, the DEBUG() messages are recorded, but only written to
+ * the file on SIGUSR1 or exit.
+ *
+ */
+void debug_init(void) {
+    debug_stdout = debug_mode;
+    if (debug_ring_path != NULL)
+        debug_mode = true;
+    if (!debug_mode)
+        return;
+
+    start_us = monotonic_us();
+    atexit(debug_exit);
+}
+
+/*
+ * Starts flushing to stdout from the given event loop, and dumping the ring
+ * buffer on SIGUSR1.
+ *
+ */
+void debug_start(struct ev_loop *loop) {
+    if (debug_stdout) {
+        ev_prepare_init(&flush_watcher, flush_cb);
+        ev_prepare_start(loop, &flush_watcher);
+    }
+    if (debug_ring_path != NULL) {
+        ev_signal_init(&dump_watcher, dump_cb, SIGUSR1);
+        ev_signal_start(loop, &dump_watcher);
+    }
+}
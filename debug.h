@@ -0,0 +1,17 @@
+#ifndef _DEBUG_H
+#define _DEBUG_H
+
+#include <stdbool.h>
+
+struct ev_loop;
+
+/* Path given by --debug-ring, or NULL. */
+extern char *debug_ring_path;
+
+void debug_init(void);
+void debug_start(struct ev_loop *loop);
+void debug_flush(void);
+void debug_flush_synchronously(void);
+void debug_dump(const char *reason);
+
+#endif
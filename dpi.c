@@ -13,6 +13,8 @@
 #include <xcb/xcb_xrm.h>
 #include "xcb.h"
 #include "i3lock.h"
+#include "randr.h"
+#include "xstats.h"
 
 extern bool debug_mode;
 
@@ -37,7 +39,7 @@ void init_dpi(void) {
         goto init_dpi_end;
     }
 
-    database = xcb_xrm_database_from_default(conn);
+    X_ROUND_TRIP("xrm_database", database = xcb_xrm_database_from_default(conn));
     if (database == NULL) {
         DEBUG("Failed to open the resource database.\n");
         goto init_dpi_end;
@@ -84,6 +86,32 @@ long get_dpi_value(void) {
     return dpi;
 }
 
+/*
+ * Returns the DPI of the given output, computed from the physical size RandR
+ * reports for it. Falls back to get_dpi_value() for outputs without a
+ * (plausible) physical size, such as projectors or virtual displays.
+ *
+ */
+long get_output_dpi(const Rect *output) {
+    if (output->mm_width == 0 || output->mm_height == 0)
+        return dpi;
+
+    /* Use the diagonal so that the result does not depend on whether the
+     * output is rotated, which not all drivers reflect in the millimeters. */
+    const double px = hypot(output->width, output->height);
+    const double mm = hypot(output->mm_width, output->mm_height);
+    const double output_dpi = px * 25.4 / mm;
+
+    /* Some EDIDs only encode the aspect ratio (e.g. 16 x 9 mm) or garbage. */
+    if (output_dpi < 48 || output_dpi > 600)
+        return dpi;
+
+    /* Physical sizes are only accurate to a few millimeters, so round to
+     * multiples of 12 dpi (1/8 of the 96 dpi baseline). Outputs of similar
+     * density then share the same scaling factor. */
+    return lround(output_dpi / 12.0) * 12;
+}
+
 /*
  * Convert a logical amount of pixels (e.g. 2 pixels on a “standard” 96 DPI
  * screen) to a corresponding amount of physical pixels on a standard or retina
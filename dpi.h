@@ -1,5 +1,7 @@
 #pragma once
 
+struct Rect;
+
 /**
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
@@ -13,6 +15,14 @@ void init_dpi(void);
  */
 long get_dpi_value(void);
 
+/**
+ * Returns the DPI of the given output, computed from the physical size RandR
+ * reports for it. Falls back to get_dpi_value() for outputs without a
+ * (plausible) physical size, such as projectors or virtual displays.
+ *
+ */
+long get_output_dpi(const struct Rect *output);
+
 /**
  * Convert a logical amount of pixels (e.g. 2 pixels on a “standard” 96 DPI
  * screen) to a corresponding amount of physical pixels on a standard or retina
@@ -0,0 +1,191 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ev.h>
+#include <xcb/xcb.h>
+#include <xcb/dpms.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "dpms.h"
+#include "unlock_indicator.h"
+#include "xstats.h"
+#include "metrics.h"
+
+/* How often the DPMS state is queried while the outputs are off, in seconds,
+ * if the X server does not send DPMSInfoNotify events (DPMS < 1.2). Only
+ * needed to notice outputs waking up without a key press, e.g. from moving
+ * the mouse, whose events i3lock does not receive. */
+#define DPMS_POLL_INTERVAL 2.0
+
+/* The same with --tickless, where the clock is not updated more often
+ * either. */
+#define TICKLESS_DPMS_POLL_INTERVAL 60.0
+
+extern bool debug_mode;
+extern bool tickless;
+
+/* Whether the X server supports DPMS. */
+static bool dpms_available = false;
+
+/* Whether the X server sends DPMSInfoNotify events, so that outputs_off is
+ * always current without asking. */
+static bool dpms_events = false;
+
+/* The major opcode of the DPMS extension, which its (generic) events carry
+ * in their extension field. */
+static uint8_t dpms_opcode;
+
+/* Whether DPMS powered down the outputs. While it did, nobody can see
+ * frames, so none are drawn (see redraw_screen()). */
+static bool outputs_off = false;
+
+static struct ev_loop *dpms_loop;
+static ev_timer dpms_poll_timer;
+
+/*
+ * Updates whether the outputs are off. Once they are on again, a frame is
+ * drawn right away, as the last one shown might be outdated.
+ *
+ */
+static void set_outputs_off(bool off) {
+    if (off == outputs_off)
+        return;
+
+    outputs_off = off;
+    DEBUG("outputs are %s\n", (off ? "off, not drawing frames" : "on again"));
+    update_time_redraw_tick();
+    if (off) {
+        if (!dpms_events && dpms_loop != NULL)
+            ev_timer_start(dpms_loop, &dpms_poll_timer);
+        return;
+    }
+
+    if (dpms_loop != NULL)
+        ev_timer_stop(dpms_loop, &dpms_poll_timer);
+    /* Frames presented right before the outputs went off might never be
+     * completed. */
+    forget_frames_in_flight();
+    redraw_screen();
+}
+
+/*
+ * Returns whether the given DPMS state means that the outputs are off. With
+ * DPMS disabled, they are never turned off.
+ *
+ */
+static bool is_off(uint16_t power_level, uint8_t state) {
+    return (state && power_level != XCB_DPMS_DPMS_MODE_ON);
+}
+
+/*
+ * Checks whether the X server supports DPMS and gets the current state. With
+ * DPMS 1.2, the X server is asked to announce state changes.
+ *
+ */
+void dpms_init(void) {
+    const xcb_query_extension_reply_t *extreply;
+
+    extreply = xcb_get_extension_data(conn, &xcb_dpms_id);
+    if (!extreply->present) {
+        DEBUG("DPMS is not present, always drawing frames.\n");
+        return;
+    }
+
+    xcb_dpms_get_version_reply_t *version;
+    X_ROUND_TRIP("dpms_get_version",
+                 version = xcb_dpms_get_version_reply(
+                     conn, xcb_dpms_get_version(conn, XCB_DPMS_MAJOR_VERSION, XCB_DPMS_MINOR_VERSION), NULL));
+    if (version == NULL)
+        return;
+
+    DEBUG("Using DPMS %d.%d\n", version->server_major_version, version->server_minor_version);
+#ifdef HAVE_XCB_DPMS_SELECT_INPUT
+    if (version->server_major_version > 1 ||
+        (version->server_major_version == 1 && version->server_minor_version >= 2)) {
+        xcb_dpms_select_input(conn, XCB_DPMS_EVENT_MASK_INFO_NOTIFY);
+        dpms_events = true;
+    }
+#endif
+    free(version);
+
+    dpms_opcode = extreply->major_opcode;
+    dpms_available = true;
+    dpms_refresh();
+}
+
+static void dpms_poll_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    metrics_wakeup(loop, WAKEUP_DPMS);
+    dpms_refresh();
+}
+
+/*
+ * Starts polling the DPMS state while the outputs are off, unless the X
+ * server announces changes. Must only be called once i3lock will not fork
+ * anymore.
+ *
+ */
+void start_dpms(struct ev_loop *loop) {
+    if (!dpms_available || dpms_loop != NULL)
+        return;
+
+    dpms_loop = loop;
+    const double interval = (tickless ? TICKLESS_DPMS_POLL_INTERVAL : DPMS_POLL_INTERVAL);
+    ev_timer_init(&dpms_poll_timer, dpms_poll_cb, interval, interval);
+    if (outputs_off && !dpms_events)
+        ev_timer_start(loop, &dpms_poll_timer);
+}
+
+/*
+ * Whether DPMS powered down the outputs, so that drawing frames is
+ * pointless.
+ *
+ */
+bool dpms_outputs_off(void) {
+    return outputs_off;
+}
+
+/*
+ * Asks the X server whether the outputs are off, unless it announces
+ * changes anyway.
+ *
+ */
+void dpms_refresh(void) {
+    if (!dpms_available || dpms_events)
+        return;
+
+    xcb_dpms_info_reply_t *info;
+    X_ROUND_TRIP("dpms_info", info = xcb_dpms_info_reply(conn, xcb_dpms_info(conn), NULL));
+    if (info == NULL)
+        return;
+    set_outputs_off(is_off(info->power_level, info->state));
+    free(info);
+}
+
+/*
+ * Called for every key press. Input makes the X server turn the outputs on,
+ * so they are on by now, and the frame for the key press is drawn.
+ *
+ */
+void dpms_input(void) {
+    set_outputs_off(false);
+}
+
+void dpms_handle_event(xcb_generic_event_t *event) {
+#ifdef HAVE_XCB_DPMS_SELECT_INPUT
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
+    if (!dpms_events || ge->extension != dpms_opcode || ge->event_type != XCB_DPMS_INFO_NOTIFY)
+        return;
+
+    xcb_dpms_info_notify_event_t *info = (xcb_dpms_info_notify_event_t *)event;
+    set_outputs_off(is_off(info->power_level, info->state));
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef _DPMS_H
+#define _DPMS_H
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+struct ev_loop;
+
+void dpms_init(void);
+void start_dpms(struct ev_loop *loop);
+bool dpms_outputs_off(void);
+void dpms_refresh(void);
+void dpms_input(void);
+void dpms_handle_event(xcb_generic_event_t *event);
+
+#endif
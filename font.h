@@ -0,0 +1,14 @@
+#ifndef _FONT_H
+#define _FONT_H
+
+#include <stdbool.h>
+#include <cairo.h>
+
+/* Whether to draw text with the embedded bitmap font instead of the fonts
+ * cairo finds through fontconfig (--builtin-font). */
+extern bool builtin_font;
+
+void builtin_font_text_extents(const char *text, double size, cairo_text_extents_t *extents);
+void builtin_font_show_text(cairo_t *ctx, const char *text, double size);
+
+#endif
@@ -21,11 +21,6 @@
 #include <err.h>
 #include <errno.h>
 #include <assert.h>
-#ifdef __OpenBSD__
-#include <bsd_auth.h>
-#else
-#include <security/pam_appl.h>
-#endif
 #include <getopt.h>
 #include <string.h>
 #include <ev.h>
@@ -47,13 +42,22 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "present.h"
+#include "metrics.h"
+#include "trace.h"
+#include "debug.h"
+#include "xstats.h"
+#include "replay.h"
+#include "auth.h"
+#include "font.h"
+#include "dpms.h"
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
 #define START_TIMER(timer_obj, timeout, callback) \
-    timer_obj = start_timer(timer_obj, timeout, callback)
+    start_timer(&(timer_obj), timeout, callback)
 #define STOP_TIMER(timer_obj) \
-    timer_obj = stop_timer(timer_obj)
+    stop_timer(&(timer_obj))
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 static void input_done(void);
@@ -73,21 +77,26 @@ int inactivity_timeout = 30;
 uint32_t last_resolution[2];
 xcb_window_t win;
 static xcb_cursor_t cursor;
-#ifndef __OpenBSD__
-static pam_handle_t *pam_handle;
-#endif
 int input_position = 0;
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
 static bool beep = false;
 bool debug_mode = false;
 bool unlock_indicator = true;
-char *modifier_string = NULL;
+/* The active modifiers, shown while the password is wrong. Empty if none. */
+char modifier_string[128];
 static bool dont_fork = false;
 struct ev_loop *main_loop;
-static struct ev_timer *clear_auth_wrong_timeout;
-static struct ev_timer *clear_indicator_timeout;
-static struct ev_timer *discard_passwd_timeout;
+/* The timers are restarted on key presses and authentication results, so they
+ * are allocated once and reused, see start_timer(). */
+static struct ev_timer clear_auth_wrong_timeout;
+static struct ev_timer clear_indicator_timeout;
+static struct ev_timer discard_passwd_timeout;
+static struct ev_timer auth_timeout_timer;
+static struct ev_timer redraw_timeout_timer;
+/* How long the authentication backend may take, in seconds, before the
+ * attempt is abandoned (see auth_timeout_cb()). 0 if unlimited. */
+static double auth_timeout = 0;
 extern unlock_state_t unlock_state;
 extern auth_state_t auth_state;
 int failed_attempts = 0;
@@ -97,14 +106,48 @@ bool retry_verification = false;
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
+/* The text of xkb_keymap, to tell whether a reloaded keymap changed. */
+static char *xkb_keymap_text;
+/* The core keyboard device, which does not change while i3lock runs. -1 if
+ * not yet known. */
+static int32_t xkb_device_id = -1;
+/* Set by XkbMapNotify and XkbNewKeyboardNotify: the keymap is reloaded before
+ * it is used next (see reload_stale_keymap()), so that a series of notifies,
+ * e.g. from setxkbmap, only reloads it once. */
+static bool keymap_stale = false;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
+/* The locale whose compose table is loaded once the screen is locked, see
+ * load_pending_compose_table(). NULL once it was loaded (or failed to
+ * load). */
+static const char *compose_locale;
+static struct ev_idle compose_loader;
 static uint8_t xkb_base_event;
 static uint8_t xkb_base_error;
 static int randr_base = -1;
 
 cairo_surface_t *img = NULL;
 bool tile = false;
+bool per_monitor_windows = false;
+
+/* How long a frame may take in milliseconds before its quality is reduced,
+ * 0 if unlimited. */
+int frame_budget = 0;
+
+/* Whether the X display is remote (e.g. SSH X forwarding or VNC). Detected
+ * from $DISPLAY and the X server, or forced with --remote. */
+bool remote_display = false;
+
+/* With --tickless, timers which expire within this many seconds of each
+ * other wake up the event loop only once. */
+#define TICKLESS_TIMER_SLACK 0.5
+
+/* Whether to wake up as rarely as possible while idle (--tickless). */
+bool tickless = false;
+
+/* When the current authentication attempt started, until the user was told
+ * that it failed (see finish_frame()). 0 if there is none. */
+uint64_t auth_started_us = 0;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
@@ -119,11 +162,33 @@ void u8_dec(char *s, int *i) {
     (void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
+/*
+ * Fetches the current keyboard state (e.g. the active modifiers and group)
+ * from the X11 server, for the already loaded keymap.
+ *
+ */
+static bool load_keyboard_state(void) {
+    struct xkb_state *new_state;
+    X_ROUND_TRIP("xkb_state_new", new_state = xkb_x11_state_new_from_device(xkb_keymap, conn, xkb_device_id));
+    if (new_state == NULL) {
+        fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        return false;
+    }
+
+    xkb_state_unref(xkb_state);
+    xkb_state = new_state;
+
+    return true;
+}
+
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
  * translate keypresses to utf-8.
  *
+ * If the keymap turns out to be the same as the loaded one, the loaded keymap
+ * and keyboard state are kept.
+ *
  */
 static bool load_keymap(void) {
     if (xkb_context == NULL) {
@@ -133,39 +198,66 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
+    if (xkb_device_id == -1) {
+        X_ROUND_TRIP("xkb_get_device_id", xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn));
+        DEBUG("device = %d\n", xkb_device_id);
+    }
 
-    int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
-    DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
+    struct xkb_keymap *new_keymap;
+    X_ROUND_TRIP("xkb_keymap_new", new_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, xkb_device_id, 0));
+    if (new_keymap == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
         return false;
     }
 
-    struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
-    if (new_state == NULL) {
-        fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
-        return false;
+    char *new_text = xkb_keymap_get_as_string(new_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    if (xkb_keymap != NULL && xkb_state != NULL &&
+        new_text != NULL && xkb_keymap_text != NULL &&
+        strcmp(new_text, xkb_keymap_text) == 0) {
+        DEBUG("keymap did not change\n");
+        free(new_text);
+        xkb_keymap_unref(new_keymap);
+        return true;
     }
 
-    xkb_state_unref(xkb_state);
-    xkb_state = new_state;
+    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap = new_keymap;
+    free(xkb_keymap_text);
+    xkb_keymap_text = new_text;
 
-    return true;
+    return load_keyboard_state();
+}
+
+/*
+ * Reloads the keymap if an XKB event announced a change since it was loaded.
+ *
+ */
+static void reload_stale_keymap(void) {
+    if (!keymap_stale)
+        return;
+    keymap_stale = false;
+    (void)load_keymap();
 }
 
 /*
- * Loads the XKB compose table from the given locale.
+ * Loads the XKB compose table from the given locale. This parses the whole
+ * Compose file of the locale, which takes several milliseconds for UTF-8
+ * locales.
  *
  */
 static bool load_compose_table(const char *locale) {
+    const uint64_t start = monotonic_us();
+    trace_span_t span = trace_begin("load_compose_table");
     xkb_compose_table_unref(xkb_compose_table);
 
-    if ((xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0)) == NULL) {
+    xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0);
+    trace_end(span);
+    if (xkb_compose_table == NULL) {
         fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
         return false;
     }
+    DEBUG("loaded the compose table for locale %s in %.3f ms\n", locale,
+          (monotonic_us() - start) / 1000.0);
 
     struct xkb_compose_state *new_compose_state = xkb_compose_state_new(xkb_compose_table, 0);
     if (new_compose_state == NULL) {
@@ -179,6 +271,28 @@ static bool load_compose_table(const char *locale) {
     return true;
 }
 
+/*
+ * Loads the compose table, unless that was done already. It is not loaded
+ * at startup, where it would delay locking the screen, but by
+ * compose_loader_cb() once the event loop is idle. Any key press before
+ * that loads it right away: compose sequences may start with any keysym
+ * (e.g. in ~/.XCompose), so every key must be fed through the table.
+ *
+ */
+static void load_pending_compose_table(void) {
+    if (compose_locale == NULL)
+        return;
+
+    load_compose_table(compose_locale);
+    compose_locale = NULL;
+    if (main_loop != NULL)
+        ev_idle_stop(main_loop, &compose_loader);
+}
+
+static void compose_loader_cb(EV_P_ ev_idle *w, int revents) {
+    load_pending_compose_table();
+}
+
 /*
  * Clears the memory which stored the password to be a bit safer against
  * cold-boot attacks.
@@ -202,29 +316,19 @@ static void clear_password_memory(void) {
 #endif
 }
 
-ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        ev_timer_set(timer_obj, timeout, 0.);
-        ev_timer_start(main_loop, timer_obj);
-    } else {
-        /* When there is no memory, we just don’t have a timeout. We cannot
-         * exit() here, since that would effectively unlock the screen. */
-        timer_obj = calloc(sizeof(struct ev_timer), 1);
-        if (timer_obj) {
-            ev_timer_init(timer_obj, callback, timeout, 0.);
-            ev_timer_start(main_loop, timer_obj);
-        }
-    }
-    return timer_obj;
+/*
+ * (Re)starts the given one-shot timer. The timer is stopped first, as libev
+ * does not allow re-initializing an active watcher.
+ *
+ */
+static void start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
+    ev_timer_stop(main_loop, timer_obj);
+    ev_timer_init(timer_obj, callback, timeout, 0.);
+    ev_timer_start(main_loop, timer_obj);
 }
 
-ev_timer *stop_timer(ev_timer *timer_obj) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        free(timer_obj);
-    }
-    return NULL;
+static void stop_timer(ev_timer *timer_obj) {
+    ev_timer_stop(main_loop, timer_obj);
 }
 
 /*
@@ -235,7 +339,9 @@ static void finish_input(void) {
     password[input_position] = '\0';
     unlock_state = STATE_KEY_PRESSED;
     redraw_screen();
+    trace_span_t span = trace_begin("input_done");
     input_done();
+    trace_end(span);
 }
 
 /*
@@ -244,27 +350,27 @@ static void finish_input(void) {
  *
  */
 static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_TIMER);
     DEBUG("clearing auth wrong\n");
     auth_state = STATE_AUTH_IDLE;
     redraw_screen();
 
     /* Clear modifier string. */
-    if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
+    modifier_string[0] = '\0';
 
-    /* Now free this timeout. */
+    /* Now stop this timeout. */
     STOP_TIMER(clear_auth_wrong_timeout);
 
     /* retry with input done during auth verification */
     if (retry_verification) {
         retry_verification = false;
+        metrics_count(COUNTER_AUTH_RETRIES, 1);
         finish_input();
     }
 }
 
 static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_TIMER);
     clear_indicator();
     STOP_TIMER(clear_indicator_timeout);
 }
@@ -276,54 +382,39 @@ static void clear_input(void) {
 }
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_TIMER);
     clear_input();
     STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_auth_wrong_timeout);
-    auth_state = STATE_AUTH_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_screen();
-
-#ifdef __OpenBSD__
-    struct passwd *pw;
-
-    if (!(pw = getpwuid(getuid())))
-        errx(1, "unknown uid %u.", getuid());
-
-    if (auth_userokay(pw->pw_name, NULL, NULL, password) != 0) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
-
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
-    }
-#else
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
-
-        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
-         * Related to credentials pam_end() needs to be called to cleanup any temporary
-         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
-         * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
-        pam_end(pam_handle, PAM_SUCCESS);
-
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
-    }
-#endif
+/*
+ * Called when the user was authenticated successfully.
+ *
+ */
+static void auth_succeeded(void) {
+    DEBUG("successfully authenticated\n");
+    STOP_TIMER(auth_timeout_timer);
+    clear_password_memory();
+    metrics_observe_since(HISTOGRAM_UNLOCK_SECONDS, auth_started_us);
+    ev_break(EV_DEFAULT, EVBREAK_ALL);
+}
 
-    if (debug_mode)
-        fprintf(stderr, "Authentication failure\n");
+/*
+ * Called when the password was wrong.
+ *
+ */
+static void auth_failed(void) {
+    DEBUG("Authentication failure\n");
+    STOP_TIMER(auth_timeout_timer);
+    metrics_count(COUNTER_AUTH_FAILURES, 1);
 
     /* Get state of Caps and Num lock modifiers, to be displayed in
      * STATE_AUTH_WRONG state */
     xkb_mod_index_t idx, num_mods;
     const char *mod_name;
+    size_t len = 0;
 
+    modifier_string[0] = '\0';
     num_mods = xkb_keymap_num_mods(xkb_keymap);
 
     for (idx = 0; idx < num_mods; idx++) {
@@ -344,19 +435,18 @@ static void input_done(void) {
         else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
             mod_name = "Super";
 
-        char *tmp;
-        if (modifier_string == NULL) {
-            if (asprintf(&tmp, "%s", mod_name) != -1)
-                modifier_string = tmp;
-        } else if (asprintf(&tmp, "%s, %s", modifier_string, mod_name) != -1) {
-            free(modifier_string);
-            modifier_string = tmp;
+        /* Names which do not fit anymore are left out. */
+        int n = snprintf(modifier_string + len, sizeof(modifier_string) - len,
+                         "%s%s", (len > 0 ? ", " : ""), mod_name);
+        if (n < 0 || (size_t)n >= sizeof(modifier_string) - len) {
+            modifier_string[len] = '\0';
+            break;
         }
+        len += n;
     }
 
     auth_state = STATE_AUTH_WRONG;
     failed_attempts += 1;
-    clear_input();
     if (unlock_indicator)
         redraw_screen();
 
@@ -376,9 +466,77 @@ static void input_done(void) {
     }
 }
 
+
+static void auth_result(bool success) {
+    if (success)
+        auth_succeeded();
+    else
+        auth_failed();
+}
+
+/*
+ * Called when the authentication backend did not answer within
+ * --auth-timeout. The attempt is abandoned and the user can retry
+ * immediately, e.g. once the network is back.
+ *
+ */
+static void auth_timeout_cb(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_TIMER);
+    STOP_TIMER(auth_timeout_timer);
+    if (!auth_in_progress())
+        return;
+
+    DEBUG("authentication backend did not answer in time\n");
+    auth_abandon();
+    metrics_count(COUNTER_AUTH_TIMEOUTS, 1);
+    auth_state = STATE_AUTH_SLOW;
+    redraw_screen();
+    STOP_TIMER(clear_indicator_timeout);
+
+    /* retry with input done during auth verification */
+    if (retry_verification) {
+        retry_verification = false;
+        metrics_count(COUNTER_AUTH_RETRIES, 1);
+        finish_input();
+    }
+}
+
+static void input_done(void) {
+    STOP_TIMER(clear_auth_wrong_timeout);
+    auth_started_us = monotonic_us();
+    auth_state = STATE_AUTH_VERIFY;
+    unlock_state = STATE_STARTED;
+    redraw_screen();
+
+    /* The password characters of a replay are all the same (see
+     * record_input_event()), so it cannot be verified, unless a stand-in
+     * PAM service (see pam/i3lock-bench-insecure) is used. */
+    if (replay_path != NULL && pam_service == NULL) {
+        clear_input();
+        auth_failed();
+        return;
+    }
+
+    if (auth_timeout > 0) {
+        ev_now_update(main_loop);
+        START_TIMER(auth_timeout_timer, auth_timeout, auth_timeout_cb);
+    }
+    metrics_count(COUNTER_AUTH_ATTEMPTS, 1);
+    /* The password is verified in a worker thread (see auth.c), which got a
+     * copy of it, so that the user can already type the next one. */
+    const bool started = auth_start(password);
+    clear_input();
+    if (!started) {
+        DEBUG("too many authentication attempts in progress\n");
+        STOP_TIMER(auth_timeout_timer);
+        auth_state = STATE_AUTH_SLOW;
+        redraw_screen();
+    }
+}
+
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_TIMER);
     redraw_screen();
-    STOP_TIMER(w);
 }
 
 static bool skip_without_validation(void) {
@@ -410,6 +568,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
     memset(buffer, '\0', sizeof(buffer));
 
+    load_pending_compose_table();
+
     if (xkb_compose_state && xkb_compose_state_feed(xkb_compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED) {
         switch (xkb_compose_state_get_status(xkb_compose_state)) {
             case XKB_COMPOSE_NOTHING:
@@ -442,7 +602,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if ((ksym == XKB_KEY_j || ksym == XKB_KEY_m) && !ctrl)
                 break;
 
-            if (auth_state == STATE_AUTH_WRONG) {
+            if (auth_state == STATE_AUTH_WRONG || auth_state == STATE_AUTH_VERIFY) {
                 retry_verification = true;
                 return;
             }
@@ -531,15 +691,21 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     /* store it in the password array as UTF-8 */
     memcpy(password + input_position, buffer, n - 1);
     input_position += n - 1;
-    DEBUG("current password = %.*s\n", input_position, password);
+    /* The ring buffer of --debug-ring is kept for long and dumped to a file,
+     * so it must not contain the password. */
+    if (debug_ring_path == NULL)
+        DEBUG("current password = %.*s\n", input_position, password);
+    else
+        DEBUG("current password length = %d\n", input_position);
 
     if (unlock_indicator) {
         unlock_state = STATE_KEY_ACTIVE;
         redraw_screen();
         unlock_state = STATE_KEY_PRESSED;
 
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
+        /* Restarted on every key press, so only the last highlight of a
+         * burst of key presses is cleared, and only once. */
+        START_TIMER(redraw_timeout_timer, TSTAMP_N_SECS(0.25), redraw_timeout);
         STOP_TIMER(clear_indicator_timeout);
     }
 
@@ -587,25 +753,27 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 
     DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
 
-    if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+    if (event->any.deviceID != xkb_device_id)
         return;
 
     /*
      * XkbNewKkdNotify and XkbMapNotify together capture all sorts of keymap
      * updates (e.g. xmodmap, xkbcomp, setxkbmap), with minimal redundent
-     * recompilations.
+     * recompilations: the keymap is only marked as stale, and reloaded once
+     * it is needed.
      */
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                keymap_stale = true;
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            keymap_stale = true;
             break;
 
         case XCB_XKB_STATE_NOTIFY:
+            reload_stale_keymap();
             xkb_state_update_mask(xkb_state,
                                   event->state_notify.baseMods,
                                   event->state_notify.latchedMods,
@@ -627,7 +795,8 @@ void handle_screen_resize(void) {
     xcb_get_geometry_cookie_t geomc;
     xcb_get_geometry_reply_t *geom;
     geomc = xcb_get_geometry(conn, screen->root);
-    if ((geom = xcb_get_geometry_reply(conn, geomc, 0)) == NULL)
+    X_ROUND_TRIP("get_geometry", geom = xcb_get_geometry_reply(conn, geomc, 0));
+    if (geom == NULL)
         return;
 
     if (last_resolution[0] == geom->width &&
@@ -827,39 +996,6 @@ static bool verify_png_image(const char *image_path) {
     return true;
 }
 
-#ifndef __OpenBSD__
-/*
- * Callback function for PAM. We only react on password request callbacks.
- *
- */
-static int conv_callback(int num_msg, const struct pam_message **msg,
-                         struct pam_response **resp, void *appdata_ptr) {
-    if (num_msg == 0)
-        return 1;
-
-    /* PAM expects an array of responses, one for each message */
-    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
-        perror("calloc");
-        return 1;
-    }
-
-    for (int c = 0; c < num_msg; c++) {
-        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
-            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
-            continue;
-
-        /* return code is currently not used but should be set to zero */
-        resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
-            perror("strdup");
-            return 1;
-        }
-    }
-
-    return 0;
-}
-#endif
-
 /*
  * This callback is only a dummy, see xcb_prepare_cb and xcb_check_cb.
  * See also man libev(3): "ev_prepare" and "ev_check" - customise your event loop
@@ -877,6 +1013,17 @@ static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
     xcb_flush(conn);
 }
 
+/*
+ * Keeps the event loop from blocking while events are left over from a
+ * batch. The events are handled by xcb_check_cb, which runs after it.
+ *
+ */
+static struct ev_idle xcb_backlog;
+
+static void xcb_backlog_cb(EV_P_ ev_idle *w, int revents) {
+    /* empty, because xcb_check_cb handles the events */
+}
+
 /*
  * Try closing logind sleep lock fd passed over from xss-lock, in case we're
  * being run from there.
@@ -898,66 +1045,184 @@ static void maybe_close_sleep_lock_fd(void) {
  * xcb_poll_for_event() which knows better than we can ever know.
  *
  */
+/*
+ * Handles a single X11 event, received from the server or replayed (see
+ * replay.c).
+ *
+ */
+static void handle_event(xcb_generic_event_t *event) {
+    /* Strip off the highest bit (set if the event is generated) */
+    int type = (event->response_type & 0x7F);
+
+    switch (type) {
+        case XCB_KEY_PRESS: {
+            dpms_input();
+            reload_stale_keymap();
+            trace_span_t span = trace_begin("handle_key_press");
+            handle_key_press((xcb_key_press_event_t *)event);
+            trace_end(span);
+            break;
+        }
+
+        case XCB_VISIBILITY_NOTIFY:
+            handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
+            break;
+
+        case XCB_EXPOSE:
+            /* Wait for the last expose event of a series. */
+            if (((xcb_expose_event_t *)event)->count == 0)
+                handle_expose();
+            break;
+
+        case XCB_MAP_NOTIFY:
+            maybe_close_sleep_lock_fd();
+            if (!dont_fork) {
+                /* After the first MapNotify, we never fork again. We don’t
+                 * expect to get another MapNotify, but better be sure… */
+                dont_fork = true;
+
+                /* In the parent process, we exit. The child takes over
+                 * the debug log, so the parent must not write it out. */
+                debug_flush();
+                record_flush();
+                if (fork() != 0)
+                    _exit(0);
+
+                ev_loop_fork(EV_DEFAULT);
+            }
+            start_render_thread(EV_DEFAULT);
+            start_auth_workers(EV_DEFAULT);
+            start_metrics(EV_DEFAULT);
+            start_dpms(EV_DEFAULT);
+            break;
+
+        case XCB_CONFIGURE_NOTIFY:
+            handle_screen_resize();
+            break;
+
+        case XCB_GE_GENERIC:
+            present_handle_event(event);
+            dpms_handle_event(event);
+            break;
+
+        default:
+            if (type == xkb_base_event) {
+                process_xkb_event(event);
+            }
+            if (randr_base > -1 &&
+                type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+                randr_query(screen->root);
+                handle_screen_resize();
+            }
+    }
+}
+
+/*
+ * Callback for xkb_keymap_key_for_each() which finds the keycode of the "x"
+ * key, see record_input_event().
+ *
+ */
+static void find_redacted_keycode(struct xkb_keymap *keymap, xkb_keycode_t key, void *data) {
+    xkb_keycode_t *keycode = data;
+    const xkb_keysym_t *syms;
+    if (*keycode == 0 &&
+        xkb_keymap_key_get_syms_by_level(keymap, key, 0, 0, &syms) == 1 &&
+        syms[0] == XKB_KEY_x)
+        *keycode = key;
+}
+
+/*
+ * Whether the given event is input which is recorded with --record.
+ *
+ */
+static bool is_input_event(int type) {
+    return (type == XCB_KEY_PRESS ||
+            type == XCB_CONFIGURE_NOTIFY ||
+            type == xkb_base_event ||
+            (randr_base > -1 && type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY));
+}
+
+/*
+ * Records the given input event. Key presses which would add a character to
+ * the password are all recorded as the "x" key, so that the recording
+ * preserves the timing, but not the password.
+ *
+ */
+static void record_input_event(xcb_generic_event_t *event) {
+    xcb_generic_event_t copy = *event;
+    if ((event->response_type & 0x7F) == XCB_KEY_PRESS) {
+        reload_stale_keymap();
+        xcb_key_press_event_t *key = (xcb_key_press_event_t *)&copy;
+        char buffer[8];
+        if (xkb_state_key_get_utf8(xkb_state, key->detail, buffer, sizeof(buffer)) > 0 &&
+            (unsigned char)buffer[0] >= 0x20 && buffer[0] != 0x7f) {
+            xkb_keycode_t keycode = 0;
+            xkb_keymap_key_for_each(xkb_keymap, find_redacted_keycode, &keycode);
+            if (keycode == 0)
+                return;
+            key->detail = keycode;
+        }
+    }
+    record_event(&copy);
+}
+
+/*
+ * Handles the queued X11 events in a batch: all input and state changes are
+ * applied first, then a single frame is drawn for them (see
+ * begin_redraw_batch()). At most MAX_EVENTS_PER_BATCH events are handled;
+ * the rest is left for the next event loop iteration, after timers and
+ * other watchers had their turn.
+ *
+ */
 static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     xcb_generic_event_t *event;
+    int events = 0;
 
     if (xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?");
 
-    while ((event = xcb_poll_for_event(conn)) != NULL) {
+    begin_redraw_batch();
+    while (events < MAX_EVENTS_PER_BATCH && (event = xcb_poll_for_event(conn)) != NULL) {
+        events++;
         if (event->response_type == 0) {
             xcb_generic_error_t *error = (xcb_generic_error_t *)event;
-            if (debug_mode)
-                fprintf(stderr, "X11 Error received! sequence 0x%x, error_code = %d\n",
-                        error->sequence, error->error_code);
+            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
+                  error->sequence, error->error_code);
             free(event);
             continue;
         }
 
-        /* Strip off the highest bit (set if the event is generated) */
-        int type = (event->response_type & 0x7F);
-
-        switch (type) {
-            case XCB_KEY_PRESS:
-                handle_key_press((xcb_key_press_event_t *)event);
-                break;
-
-            case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
-                break;
-
-            case XCB_MAP_NOTIFY:
-                maybe_close_sleep_lock_fd();
-                if (!dont_fork) {
-                    /* After the first MapNotify, we never fork again. We don’t
-                     * expect to get another MapNotify, but better be sure… */
-                    dont_fork = true;
-
-                    /* In the parent process, we exit */
-                    if (fork() != 0)
-                        exit(0);
-
-                    ev_loop_fork(EV_DEFAULT);
-                }
-                break;
-
-            case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
-                break;
-
-            default:
-                if (type == xkb_base_event) {
-                    process_xkb_event(event);
-                }
-                if (randr_base > -1 &&
-                    type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
-                    randr_query(screen->root);
-                    handle_screen_resize();
-                }
+        const int type = (event->response_type & 0x7F);
+        if (is_input_event(type)) {
+            /* While replaying, the keyboard is only driven by the
+             * recording. */
+            if (replay_path != NULL && (type == XCB_KEY_PRESS || type == xkb_base_event)) {
+                free(event);
+                continue;
+            }
+            if (record_path != NULL)
+                record_input_event(event);
         }
 
+        handle_event(event);
         free(event);
     }
+    /* Load a changed keymap right away, instead of on the next key press. */
+    reload_stale_keymap();
+    end_redraw_batch(events);
+
+    /* The remaining events are already read from the socket, so the event
+     * loop must not block until they are handled. */
+    if (events == MAX_EVENTS_PER_BATCH)
+        ev_idle_start(EV_A_ &xcb_backlog);
+    else
+        ev_idle_stop(EV_A_ &xcb_backlog);
+
+    if (events > 0) {
+        metrics_wakeup(EV_A_ WAKEUP_X11);
+        metrics_count(COUNTER_X_EVENTS, events);
+        metrics_observe(HISTOGRAM_EVENTS_PER_BATCH, events);
+    }
 }
 
 /*
@@ -965,14 +1230,19 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
  * window when the window is obscured, even when the main i3lock process is
  * blocked due to the authentication backend.
  *
+ * The child must leave with _exit(), so that the atexit() handlers it
+ * inherited (e.g. of the debug log) only run in the main process.
+ *
  */
 static void raise_loop(xcb_window_t window) {
     xcb_connection_t *conn;
     xcb_generic_event_t *event;
     int screens;
 
-    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0)
-        errx(EXIT_FAILURE, "Cannot open display");
+    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0) {
+        warnx("Cannot open display");
+        _exit(EXIT_FAILURE);
+    }
 
     /* We need to know about the window being obscured or getting destroyed. */
     xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
@@ -1000,12 +1270,12 @@ static void raise_loop(xcb_window_t window) {
             case XCB_UNMAP_NOTIFY:
                 DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
                 if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
+                    _exit(EXIT_SUCCESS);
                 break;
             case XCB_DESTROY_NOTIFY:
                 DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
                 if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
+                    _exit(EXIT_SUCCESS);
                 break;
             default:
                 DEBUG("Unhandled event type %d\n", type);
@@ -1035,10 +1305,6 @@ int main(int argc, char *argv[]) {
     char *username;
     char *image_path = NULL;
     char *image_raw_format = NULL;
-#ifndef __OpenBSD__
-    int ret;
-    struct pam_conv conv = {conv_callback, NULL};
-#endif
     int curs_choice = CURS_NONE;
     int o;
     int longoptind = 0;
@@ -1062,6 +1328,19 @@ int main(int argc, char *argv[]) {
         {"wrong-color", required_argument, NULL, 'w'},
         {"idle-color", required_argument, NULL, 'l'},
         {"24", no_argument, NULL, '4'},
+        {"per-monitor", no_argument, NULL, 0},
+        {"frame-budget", required_argument, NULL, 0},
+        {"remote", no_argument, NULL, 0},
+        {"metrics-socket", required_argument, NULL, 0},
+        {"metrics-textfile", required_argument, NULL, 0},
+        {"trace", required_argument, NULL, 0},
+        {"debug-ring", required_argument, NULL, 0},
+        {"record", required_argument, NULL, 0},
+        {"replay", required_argument, NULL, 0},
+        {"pam-service", required_argument, NULL, 0},
+        {"auth-timeout", required_argument, NULL, 0},
+        {"builtin-font", no_argument, NULL, 0},
+        {"tickless", no_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}
     };
 
@@ -1071,7 +1350,7 @@ int main(int argc, char *argv[]) {
         errx(EXIT_FAILURE, "pw->pw_name is NULL.");
 
     char *optstring = "hvnbdc:o:w:l:p:ui:teI:f";
-    while ((o = getopt_long(argc, argv, optstring, longopts, &optind)) != -1) {
+    while ((o = getopt_long(argc, argv, optstring, longopts, &longoptind)) != -1) {
         switch (o) {
             case 'v':
                 errx(EXIT_SUCCESS, "version " I3LOCK_VERSION " © 2010 Michael Stapelberg");
@@ -1129,29 +1408,76 @@ int main(int argc, char *argv[]) {
                     debug_mode = true;
                 else if (strcmp(longopts[longoptind].name, "raw") == 0)
                     image_raw_format = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "per-monitor") == 0)
+                    per_monitor_windows = true;
+                else if (strcmp(longopts[longoptind].name, "frame-budget") == 0) {
+                    char *endptr;
+                    long budget = strtol(optarg, &endptr, 10);
+                    if (*optarg == '\0' || *endptr != '\0' || budget < 0 || budget > 10000)
+                        errx(EXIT_FAILURE, "i3lock: Invalid frame budget given. Expected a number of milliseconds.");
+                    frame_budget = budget;
+                } else if (strcmp(longopts[longoptind].name, "remote") == 0)
+                    remote_display = true;
+                else if (strcmp(longopts[longoptind].name, "metrics-socket") == 0)
+                    metrics_socket_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "metrics-textfile") == 0)
+                    metrics_textfile_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "trace") == 0)
+                    trace_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "debug-ring") == 0)
+                    debug_ring_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "record") == 0)
+                    record_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "replay") == 0)
+                    replay_path = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "pam-service") == 0)
+                    pam_service = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "auth-timeout") == 0) {
+                    char *endptr;
+                    double timeout = strtod(optarg, &endptr);
+                    if (*optarg == '\0' || *endptr != '\0' || timeout < 0 || timeout > 3600)
+                        errx(EXIT_FAILURE, "i3lock: Invalid authentication timeout given. Expected a number of seconds.");
+                    auth_timeout = timeout;
+                } else if (strcmp(longopts[longoptind].name, "builtin-font") == 0)
+                    builtin_font = true;
+                else if (strcmp(longopts[longoptind].name, "tickless") == 0)
+                    tickless = true;
                 break;
             case 'f':
                 show_failed_attempts = true;
                 break;
             default:
                 errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b] [-d] [-c color] [-o color] [-w color] [-l color] [-u] [-p win|default]"
-                " [-i image.png] [-t] [-e] [-I timeout] [-f] [--24]"
+                 " [-i image.png] [-t] [-e] [-I timeout] [-f] [--24] [--per-monitor] [--frame-budget ms] [--remote]"
+                 " [--metrics-socket path] [--metrics-textfile path] [--trace file] [--debug-ring file]"
+                 " [--record file] [--replay file] [--pam-service name]"
+                 " [--auth-timeout seconds] [--builtin-font] [--tickless]"
                 );
         }
     }
 
+    /* Another PAM service is only for benchmarking the authentication of a
+     * replay (see pam/i3lock-bench-insecure): a real session is always locked
+     * with the "i3lock" service. */
+    if (pam_service != NULL && replay_path == NULL)
+        errx(EXIT_FAILURE, "--pam-service can only be used together with --replay");
+
+    trace_init();
+    debug_init();
+
     /* We need (relatively) random numbers for highlighting a random part of
-     * the unlock indicator upon keypresses. */
-    srand(time(NULL));
+     * the unlock indicator upon keypresses. A replay uses the same ones as
+     * the recording. */
+    uint32_t seed = time(NULL);
+    if (replay_path != NULL) {
+        seed = replay_init();
+        dont_fork = true;
+    }
+    seed_highlight(seed);
+    record_init(seed);
 
-#ifndef __OpenBSD__
     /* Initialize PAM */
-    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-
-    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-#endif
+    auth_init(username, auth_result);
 
 /* Using mlock() as non-super-user seems only possible in Linux.
  * Users of other operating systems should use encrypted swap/no swap
@@ -1171,15 +1497,24 @@ int main(int argc, char *argv[]) {
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
-
-    if (xkb_x11_setup_xkb_extension(conn,
-                                    XKB_X11_MIN_MAJOR_XKB_VERSION,
-                                    XKB_X11_MIN_MINOR_XKB_VERSION,
-                                    0,
-                                    NULL,
-                                    NULL,
-                                    &xkb_base_event,
-                                    &xkb_base_error) != 1)
+    xstats_init();
+
+    if (!remote_display)
+        remote_display = is_remote_display(conn, getenv("DISPLAY"));
+    if (remote_display)
+        DEBUG("X display is remote, only redrawing the unlock indicators\n");
+
+    int xkb_setup;
+    X_ROUND_TRIP("xkb_setup_extension",
+                 xkb_setup = xkb_x11_setup_xkb_extension(conn,
+                                                         XKB_X11_MIN_MAJOR_XKB_VERSION,
+                                                         XKB_X11_MIN_MINOR_XKB_VERSION,
+                                                         0,
+                                                         NULL,
+                                                         NULL,
+                                                         &xkb_base_event,
+                                                         &xkb_base_error));
+    if (xkb_setup != 1)
         errx(EXIT_FAILURE, "Could not setup XKB extension.");
 
     static const xcb_xkb_map_part_t required_map_parts =
@@ -1196,9 +1531,12 @@ int main(int argc, char *argv[]) {
          XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
          XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
 
+    /* The device id is kept for load_keymap() and the XKB events. */
+    X_ROUND_TRIP("xkb_get_device_id", xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn));
+    DEBUG("device = %d\n", xkb_device_id);
     xcb_xkb_select_events(
         conn,
-        xkb_x11_get_core_keyboard_device_id(conn),
+        xkb_device_id,
         required_events,
         0,
         required_events,
@@ -1216,18 +1554,20 @@ int main(int argc, char *argv[]) {
     if (!locale || !*locale)
         locale = getenv("LANG");
     if (!locale || !*locale) {
-        if (debug_mode)
-            fprintf(stderr, "Can't detect your locale, fallback to C\n");
+        DEBUG("Can't detect your locale, fallback to C\n");
         locale = "C";
     }
 
-    load_compose_table(locale);
+    /* The compose table is loaded once the screen is locked. */
+    compose_locale = locale;
 
     screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
 
     init_dpi();
 
     randr_init(&randr_base, screen->root);
+    present_init();
+    dpms_init();
     randr_query(screen->root);
 
     last_resolution[0] = screen->width_in_pixels;
@@ -1236,6 +1576,7 @@ int main(int argc, char *argv[]) {
     xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
+    trace_span_t image_span = trace_begin("load_image");
     if (image_raw_format != NULL && image_path != NULL) {
         /* Read image. 'read_raw_image' returns NULL on error,
          * so we don't have to handle errors here. */
@@ -1250,6 +1591,7 @@ int main(int argc, char *argv[]) {
             img = NULL;
         }
     }
+    trace_end(image_span);
 
     free(image_path);
     free(image_raw_format);
@@ -1261,7 +1603,10 @@ int main(int argc, char *argv[]) {
 
     /* Open the fullscreen window, already with the correct pixmap in place */
     win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
+    present_select_window(win);
+    /* With --per-monitor, the screens are covered by child windows. */
+    if (bg_pixmap == XCB_NONE)
+        redraw_screen();
 
     cursor = create_cursor(conn, screen, win, curs_choice);
 
@@ -1285,6 +1630,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /* The child only wakes up when the window is obscured, so it is kept
+     * with --tickless as well. The pending debug messages are printed first,
+     * as the child would print them again. */
+    debug_flush();
+    record_flush();
     pid_t pid = fork();
     /* The pid == -1 case is intentionally ignored here:
      * While the child process is useful for preventing other windows from
@@ -1293,20 +1643,25 @@ int main(int argc, char *argv[]) {
         /* Child */
         close(xcb_get_file_descriptor(conn));
         maybe_close_sleep_lock_fd();
+        /* The child has no event loop to flush its debug messages. */
+        debug_flush_synchronously();
         raise_loop(win);
-        exit(EXIT_SUCCESS);
+        _exit(EXIT_SUCCESS);
     }
 
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
+    /* Sync the current modifier state. Since we first loaded the keymap, the
+     * modifiers might have changed, but starting from now, we should get all
+     * key presses/releases due to having grabbed the keyboard. The keymap
+     * itself does not need to be fetched and compiled again: changes to it
+     * are announced by XKB events, see process_xkb_event(). */
+    (void)load_keyboard_state();
 
     /* Initialize the libev event loop. */
     main_loop = EV_DEFAULT;
     if (main_loop == NULL)
         errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
+    if (tickless)
+        ev_set_timeout_collect_interval(main_loop, TICKLESS_TIMER_SLACK);
 
     /* Explicitly call the screen redraw in case "locking…" message was displayed */
     auth_state = STATE_AUTH_IDLE;
@@ -1319,20 +1674,32 @@ int main(int argc, char *argv[]) {
     ev_io_init(xcb_watcher, xcb_got_event, xcb_get_file_descriptor(conn), EV_READ);
     ev_io_start(main_loop, xcb_watcher);
 
+    ev_idle_init(&xcb_backlog, xcb_backlog_cb);
+
     ev_check_init(xcb_check, xcb_check_cb);
     ev_check_start(main_loop, xcb_check);
 
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
+    ev_idle_init(&compose_loader, compose_loader_cb);
+    ev_idle_start(main_loop, &compose_loader);
+
     /* Invoke the event callback once to catch all the events which were
      * received up until now. ev will only pick up new events (when the X11
      * file descriptor becomes readable). */
     ev_invoke(main_loop, xcb_check, 0);
 
     start_time_redraw_tick(main_loop);
+    debug_start(main_loop);
+
+    if (replay_path != NULL)
+        start_replay(main_loop, handle_event);
 
+    xstats_set_phase(PHASE_STEADY);
     ev_loop(main_loop, 0);
+    xstats_set_phase(PHASE_UNLOCK);
+    finish_replay();
 
     if (stolen_focus == XCB_NONE) {
         return 0;
@@ -1343,7 +1710,7 @@ int main(int argc, char *argv[]) {
     xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
     xcb_destroy_window(conn, win);
     set_focused_window(conn, screen->root, stolen_focus);
-    xcb_aux_sync(conn);
+    X_ROUND_TRIP("restore_focus", xcb_aux_sync(conn));
 
     return 0;
 }
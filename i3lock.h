@@ -1,14 +1,24 @@
 #ifndef _I3LOCK_H
 #define _I3LOCK_H
 
-/* This macro will only print debug output when started with --debug.
- * This is important because xautolock (for example) closes stdout/stderr by
- * default, so just printing something to stdout will lead to the data ending
- * up on the X11 socket (!). */
-#define DEBUG(fmt, ...)                                   \
-    do {                                                  \
-        if (debug_mode)                                   \
-            printf("[i3lock-debug] " fmt, ##__VA_ARGS__); \
+/* This macro will only record debug output when started with --debug (or
+ * --debug-ring). This is important because xautolock (for example) closes
+ * stdout/stderr by default, so just printing something to stdout will lead to
+ * the data ending up on the X11 socket (!).
+ *
+ * Messages go to an in-memory ring buffer and are written out later (see
+ * debug.c), so that logging does not slow down key presses or redraws. */
+#define DEBUG(fmt, ...)                          \
+    do {                                         \
+        if (debug_mode)                          \
+            debug_log(fmt, ##__VA_ARGS__);       \
     } while (0)
 
+/* At most this many X11 events (received or replayed) are handled per event
+ * loop iteration, so that a held key or a flood of XKB state notifies cannot
+ * starve timers and finished frames. */
+#define MAX_EVENTS_PER_BATCH 64
+
+void debug_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
 #endif
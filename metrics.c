@@ -0,0 +1,403 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "metrics.h"
+#include "xstats.h"
+
+/* How often the textfile is rewritten, in seconds. */
+#define TEXTFILE_INTERVAL 15.0
+
+/* Paths given by --metrics-socket and --metrics-textfile, or NULL. */
+char *metrics_socket_path = NULL;
+char *metrics_textfile_path = NULL;
+
+extern bool debug_mode;
+
+/* The counters and histograms are updated from the event loop as well as
+ * from the render threads, so they are only accessed atomically. That keeps
+ * recording cheap enough to always be enabled. */
+typedef struct {
+    const char *name;
+    const char *help;
+    uint64_t value;
+} counter_metric_t;
+
+static counter_metric_t counters[COUNTERS_COUNT] = {
+    [COUNTER_FRAMES] = {"i3lock_frames", "Frames shown."},
+    [COUNTER_FRAMES_DROPPED] = {"i3lock_frames_dropped", "Redraws superseded by a later one before they were started."},
+    [COUNTER_FRAMES_SKIPPED] = {"i3lock_frames_skipped", "Redraws skipped because DPMS turned the outputs off."},
+    [COUNTER_AUTH_ATTEMPTS] = {"i3lock_auth_attempts", "Authentication attempts."},
+    [COUNTER_AUTH_FAILURES] = {"i3lock_auth_failures", "Failed authentication attempts."},
+    [COUNTER_AUTH_TIMEOUTS] = {"i3lock_auth_timeouts", "Authentication attempts abandoned after --auth-timeout."},
+    [COUNTER_AUTH_RETRIES] = {"i3lock_auth_retries", "Passwords typed ahead while the previous one was verified, and verified afterwards."},
+    [COUNTER_GRAB_ATTEMPTS] = {"i3lock_grab_attempts", "Attempts to grab the pointer or keyboard."},
+    [COUNTER_RANDR_QUERIES] = {"i3lock_randr_queries", "Queries of the screen configuration."},
+    [COUNTER_X_EVENTS] = {"i3lock_x_events", "X11 events processed."},
+};
+
+/* Event loop wakeups by source. Only updated by the event loop. */
+static struct {
+    const char *source;
+    uint64_t value;
+} wakeups[WAKEUPS_COUNT] = {
+    [WAKEUP_X11] = {"x11"},
+    [WAKEUP_CLOCK] = {"clock"},
+    [WAKEUP_TIMER] = {"timer"},
+    [WAKEUP_AUTH] = {"auth"},
+    [WAKEUP_RENDER] = {"render"},
+    [WAKEUP_METRICS] = {"metrics"},
+    [WAKEUP_DPMS] = {"dpms"},
+    [WAKEUP_SIGNAL] = {"signal"},
+    [WAKEUP_REPLAY] = {"replay"},
+};
+
+#define MAX_BUCKETS 16
+
+typedef struct {
+    const char *name;
+    const char *help;
+    /* Upper bounds of the buckets, ascending. The +Inf bucket is implied. */
+    double bounds[MAX_BUCKETS];
+    int bounds_len;
+    /* Not cumulative, the last one is the +Inf bucket. */
+    uint64_t buckets[MAX_BUCKETS + 1];
+    /* The sum of all values in millionths, so that it can be updated
+     * atomically. */
+    uint64_t sum_millionths;
+} histogram_metric_t;
+
+#define SECONDS_BUCKETS {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5}, 12
+#define AUTH_BUCKETS {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0}, 11
+
+static histogram_metric_t histograms[HISTOGRAMS_COUNT] = {
+    [HISTOGRAM_FRAME_SECONDS] = {"i3lock_frame_seconds", "Time from starting a frame until it was shown.", SECONDS_BUCKETS},
+    [HISTOGRAM_PREPARE_SECONDS] = {"i3lock_frame_prepare_seconds", "Time taken to snapshot the state for a frame.", SECONDS_BUCKETS},
+    [HISTOGRAM_RENDER_SECONDS] = {"i3lock_frame_render_seconds", "Time taken to render the unlock indicators of a frame.", SECONDS_BUCKETS},
+    [HISTOGRAM_COMPOSE_SECONDS] = {"i3lock_frame_compose_seconds", "Time taken to composite and show a rendered frame.", SECONDS_BUCKETS},
+    [HISTOGRAM_BACKGROUND_SECONDS] = {"i3lock_background_seconds", "Time taken to render the background.", SECONDS_BUCKETS},
+    [HISTOGRAM_PRESENT_LATENCY_SECONDS] = {"i3lock_present_latency_seconds", "Time from requesting a redraw until the frame was presented.", SECONDS_BUCKETS},
+    [HISTOGRAM_AUTH_SECONDS] = {"i3lock_auth_seconds", "Time taken by the authentication backend.", AUTH_BUCKETS},
+    [HISTOGRAM_AUTH_VERIFY_SHOWN_SECONDS] = {"i3lock_auth_verify_shown_seconds", "Time from submitting a password until the verifying state was shown.", SECONDS_BUCKETS},
+    [HISTOGRAM_AUTH_WRONG_SHOWN_SECONDS] = {"i3lock_auth_wrong_shown_seconds", "Time from submitting a wrong password until that was shown.", AUTH_BUCKETS},
+    [HISTOGRAM_UNLOCK_SECONDS] = {"i3lock_unlock_seconds", "Time from submitting the right password until unlocking.", AUTH_BUCKETS},
+    [HISTOGRAM_EVENTS_PER_BATCH] = {"i3lock_events_per_batch", "X11 events processed per event loop iteration.", {1, 2, 4, 8, 16, 32, 64, 128, 256}, 9},
+    [HISTOGRAM_X_ROUND_TRIP_SECONDS] = {"i3lock_x_round_trip_seconds", "Time spent waiting for a reply from the X server.", SECONDS_BUCKETS},
+    [HISTOGRAM_EVENT_BATCH_SECONDS] = {"i3lock_event_batch_seconds", "Time taken to handle a batch of X11 events and start its frame, during which the event loop is stalled.", SECONDS_BUCKETS},
+};
+
+typedef struct {
+    const char *name;
+    const char *help;
+    /* In millionths, like histogram_metric_t.sum_millionths. */
+    uint64_t value_millionths;
+} gauge_metric_t;
+
+static gauge_metric_t gauges[GAUGES_COUNT] = {
+    [GAUGE_MAX_EVENT_BATCH_SECONDS] = {"i3lock_event_batch_max_seconds", "Longest time taken to handle a batch of X11 events, i.e. the worst stall of the event loop."},
+    [GAUGE_FIRST_RENDER_SECONDS] = {"i3lock_first_render_seconds", "Time taken to render the unlock indicators of the first frame, which includes loading the fonts unless --builtin-font is given."},
+};
+
+static int metrics_socket = -1;
+static ev_io metrics_socket_watcher;
+static ev_timer metrics_textfile_timer;
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in microseconds.
+ *
+ */
+uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_count(counter_t counter, uint64_t n) {
+    __atomic_add_fetch(&counters[counter].value, n, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_value(counter_t counter) {
+    return __atomic_load_n(&counters[counter].value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(histogram_t histogram, double value) {
+    histogram_metric_t *h = &histograms[histogram];
+    int bucket = 0;
+    while (bucket < h->bounds_len && value > h->bounds[bucket])
+        bucket++;
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    if (value > 0)
+        __atomic_add_fetch(&h->sum_millionths, (uint64_t)(value * 1000000), __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the mean of all values recorded in the given histogram, 0 if
+ * there are none.
+ *
+ */
+double metrics_mean(histogram_t histogram) {
+    const histogram_metric_t *h = &histograms[histogram];
+    uint64_t count = 0;
+    for (int b = 0; b <= h->bounds_len; b++)
+        count += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+    return __atomic_load_n(&h->sum_millionths, __ATOMIC_RELAXED) / 1000000.0 / count;
+}
+
+/*
+ * Records the time since start_us (see monotonic_us()) in seconds.
+ *
+ */
+void metrics_observe_since(histogram_t histogram, uint64_t start_us) {
+    metrics_observe(histogram, (monotonic_us() - start_us) / 1000000.0);
+}
+
+/*
+ * Called by every watcher callback of the event loop with what it handles.
+ * Only the first callback of an event loop iteration is counted, as it is
+ * (one of) the reason(s) the event loop woke up.
+ *
+ */
+void metrics_wakeup(struct ev_loop *loop, wakeup_t source) {
+    static bool counted = false;
+    static unsigned int counted_iteration;
+    const unsigned int iteration = ev_iteration(loop);
+    if (counted && iteration == counted_iteration)
+        return;
+    counted = true;
+    counted_iteration = iteration;
+    wakeups[source].value++;
+}
+
+/*
+ * Returns the number of event loop wakeups so far, from all sources.
+ *
+ */
+uint64_t metrics_wakeups(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < WAKEUPS_COUNT; i++)
+        total += wakeups[i].value;
+    return total;
+}
+
+void metrics_gauge_set(gauge_t gauge, double value) {
+    __atomic_store_n(&gauges[gauge].value_millionths, (value > 0 ? (uint64_t)(value * 1000000) : 0), __ATOMIC_RELAXED);
+}
+
+/*
+ * Raises the given gauge to value, unless it already is higher.
+ *
+ */
+void metrics_gauge_max(gauge_t gauge, double value) {
+    const uint64_t millionths = (value > 0 ? (uint64_t)(value * 1000000) : 0);
+    uint64_t current = __atomic_load_n(&gauges[gauge].value_millionths, __ATOMIC_RELAXED);
+    while (millionths > current &&
+           !__atomic_compare_exchange_n(&gauges[gauge].value_millionths, &current, millionths,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+double metrics_gauge(gauge_t gauge) {
+    return __atomic_load_n(&gauges[gauge].value_millionths, __ATOMIC_RELAXED) / 1000000.0;
+}
+
+/*
+ * Writes all metrics in the OpenMetrics text format.
+ *
+ */
+static void print_metrics(FILE *f) {
+    for (int i = 0; i < COUNTERS_COUNT; i++) {
+        const counter_metric_t *c = &counters[i];
+        fprintf(f, "# TYPE %s counter\n", c->name);
+        fprintf(f, "# HELP %s %s\n", c->name, c->help);
+        fprintf(f, "%s_total %llu\n", c->name,
+                (unsigned long long)__atomic_load_n(&c->value, __ATOMIC_RELAXED));
+    }
+
+    fprintf(f, "# TYPE i3lock_wakeups counter\n");
+    fprintf(f, "# HELP i3lock_wakeups Event loop wakeups, by what woke it up.\n");
+    for (int i = 0; i < WAKEUPS_COUNT; i++)
+        fprintf(f, "i3lock_wakeups_total{source=\"%s\"} %llu\n", wakeups[i].source,
+                (unsigned long long)wakeups[i].value);
+
+    for (int i = 0; i < HISTOGRAMS_COUNT; i++) {
+        histogram_metric_t *h = &histograms[i];
+        fprintf(f, "# TYPE %s histogram\n", h->name);
+        fprintf(f, "# HELP %s %s\n", h->name, h->help);
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= h->bounds_len; b++) {
+            cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            if (b < h->bounds_len)
+                fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", h->name, h->bounds[b], (unsigned long long)cumulative);
+            else
+                fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, (unsigned long long)cumulative);
+        }
+        fprintf(f, "%s_sum %.6f\n", h->name,
+                __atomic_load_n(&h->sum_millionths, __ATOMIC_RELAXED) / 1000000.0);
+        fprintf(f, "%s_count %llu\n", h->name, (unsigned long long)cumulative);
+    }
+
+    for (int i = 0; i < GAUGES_COUNT; i++) {
+        const gauge_metric_t *g = &gauges[i];
+        fprintf(f, "# TYPE %s gauge\n", g->name);
+        fprintf(f, "# HELP %s %s\n", g->name, g->help);
+        fprintf(f, "%s %.6f\n", g->name, metrics_gauge(i));
+    }
+    xstats_print_metrics(f);
+    fprintf(f, "# EOF\n");
+}
+
+/*
+ * Writes the metrics to the textfile. A temporary file is renamed over it,
+ * so that readers (e.g. the node_exporter textfile collector) never see a
+ * partially written file.
+ *
+ */
+static void write_textfile(void) {
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.%d.tmp", metrics_textfile_path, getpid()) == -1)
+        return;
+
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        DEBUG("Could not write metrics to %s\n", tmp_path);
+        free(tmp_path);
+        return;
+    }
+    print_metrics(f);
+    if (fclose(f) != 0 || rename(tmp_path, metrics_textfile_path) != 0) {
+        DEBUG("Could not write metrics to %s\n", metrics_textfile_path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+static void textfile_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    metrics_wakeup(loop, WAKEUP_METRICS);
+    write_textfile();
+}
+
+/*
+ * Sends the metrics to a client connecting to the metrics socket, then
+ * closes the connection. The report is formatted in memory and sent without
+ * blocking: a client which does not read it fast enough (the whole report
+ * normally fits into the socket buffer) is dropped instead of stalling the
+ * event loop.
+ *
+ */
+static void metrics_socket_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    metrics_wakeup(loop, WAKEUP_METRICS);
+    int client = accept(metrics_socket, NULL, NULL);
+    if (client == -1)
+        return;
+    if (fcntl(client, F_SETFL, O_NONBLOCK) == -1) {
+        close(client);
+        return;
+    }
+
+    char *report = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&report, &len);
+    if (f == NULL) {
+        close(client);
+        return;
+    }
+    print_metrics(f);
+    if (fclose(f) == 0) {
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t n = send(client, report + sent, len - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                DEBUG("Dropping metrics client: %s\n", n == 0 ? "closed" : strerror(errno));
+                break;
+            }
+            sent += n;
+        }
+    }
+    free(report);
+    close(client);
+}
+
+static void metrics_exit(void) {
+    if (metrics_textfile_path != NULL)
+        write_textfile();
+    if (metrics_socket != -1)
+        unlink(metrics_socket_path);
+}
+
+/*
+ * Starts exporting the metrics on the metrics socket and/or the textfile.
+ * Must only be called once i3lock will not fork anymore, as the metrics are
+ * exported (and cleaned up on exit) by the process that stays running.
+ *
+ */
+void start_metrics(struct ev_loop *loop) {
+    static bool started = false;
+    if (started)
+        return;
+    started = true;
+
+    if (metrics_socket_path != NULL) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(metrics_socket_path) >= sizeof(addr.sun_path)) {
+            warnx("metrics socket path too long: %s", metrics_socket_path);
+        } else {
+            strcpy(addr.sun_path, metrics_socket_path);
+
+            /* Replace a stale socket of a previous instance, but nothing
+             * else. */
+            struct stat st;
+            if (lstat(metrics_socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(metrics_socket_path);
+
+            /* Only the user running i3lock may connect: the socket is
+             * created with mode 0600 instead of depending on the umask. */
+            metrics_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int bound = -1;
+            if (metrics_socket != -1) {
+                const mode_t old_umask = umask(0177);
+                bound = bind(metrics_socket, (struct sockaddr *)&addr, sizeof(addr));
+                umask(old_umask);
+            }
+            if (bound == -1 || listen(metrics_socket, 4) == -1) {
+                warn("Could not listen on metrics socket %s", metrics_socket_path);
+                if (metrics_socket != -1)
+                    close(metrics_socket);
+                metrics_socket = -1;
+            } else {
+                ev_io_init(&metrics_socket_watcher, metrics_socket_cb, metrics_socket, EV_READ);
+                ev_io_start(loop, &metrics_socket_watcher);
+            }
+        }
+    }
+
+    if (metrics_textfile_path != NULL) {
+        write_textfile();
+        ev_timer_init(&metrics_textfile_timer, textfile_timer_cb, TEXTFILE_INTERVAL, TEXTFILE_INTERVAL);
+        ev_timer_start(loop, &metrics_textfile_timer);
+    }
+
+    if (metrics_socket != -1 || metrics_textfile_path != NULL)
+        atexit(metrics_exit);
+}
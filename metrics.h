@@ -0,0 +1,76 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+struct ev_loop;
+
+typedef enum {
+    COUNTER_FRAMES = 0,
+    COUNTER_FRAMES_DROPPED,
+    COUNTER_FRAMES_SKIPPED,
+    COUNTER_AUTH_ATTEMPTS,
+    COUNTER_AUTH_FAILURES,
+    COUNTER_AUTH_RETRIES,
+    COUNTER_AUTH_TIMEOUTS,
+    COUNTER_GRAB_ATTEMPTS,
+    COUNTER_RANDR_QUERIES,
+    COUNTER_X_EVENTS,
+    COUNTERS_COUNT,
+} counter_t;
+
+typedef enum {
+    HISTOGRAM_FRAME_SECONDS = 0,
+    HISTOGRAM_PREPARE_SECONDS,
+    HISTOGRAM_RENDER_SECONDS,
+    HISTOGRAM_COMPOSE_SECONDS,
+    HISTOGRAM_BACKGROUND_SECONDS,
+    HISTOGRAM_PRESENT_LATENCY_SECONDS,
+    HISTOGRAM_AUTH_SECONDS,
+    HISTOGRAM_AUTH_VERIFY_SHOWN_SECONDS,
+    HISTOGRAM_AUTH_WRONG_SHOWN_SECONDS,
+    HISTOGRAM_UNLOCK_SECONDS,
+    HISTOGRAM_EVENTS_PER_BATCH,
+    HISTOGRAM_X_ROUND_TRIP_SECONDS,
+    HISTOGRAM_EVENT_BATCH_SECONDS,
+    HISTOGRAMS_COUNT,
+} histogram_t;
+
+/* What woke up the event loop, see metrics_wakeup(). */
+typedef enum {
+    WAKEUP_X11 = 0,
+    WAKEUP_CLOCK,
+    WAKEUP_TIMER,
+    WAKEUP_AUTH,
+    WAKEUP_RENDER,
+    WAKEUP_METRICS,
+    WAKEUP_DPMS,
+    WAKEUP_SIGNAL,
+    WAKEUP_REPLAY,
+    WAKEUPS_COUNT,
+} wakeup_t;
+
+typedef enum {
+    GAUGE_MAX_EVENT_BATCH_SECONDS = 0,
+    GAUGE_FIRST_RENDER_SECONDS,
+    GAUGES_COUNT,
+} gauge_t;
+
+/* Paths given by --metrics-socket and --metrics-textfile, or NULL. */
+extern char *metrics_socket_path;
+extern char *metrics_textfile_path;
+
+uint64_t monotonic_us(void);
+void metrics_count(counter_t counter, uint64_t n);
+uint64_t metrics_value(counter_t counter);
+double metrics_mean(histogram_t histogram);
+void metrics_observe(histogram_t histogram, double value);
+void metrics_observe_since(histogram_t histogram, uint64_t start_us);
+void metrics_wakeup(struct ev_loop *loop, wakeup_t source);
+uint64_t metrics_wakeups(void);
+void metrics_gauge_set(gauge_t gauge, double value);
+void metrics_gauge_max(gauge_t gauge, double value);
+double metrics_gauge(gauge_t gauge);
+void start_metrics(struct ev_loop *loop);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "present.h"
+#include "unlock_indicator.h"
+#include "xstats.h"
+
+/* Whether frames are shown using the Present extension. */
+bool use_present = false;
+
+/* The major opcode of the Present extension, which its (generic) events
+ * carry in their extension field. */
+static uint8_t present_opcode;
+
+/* Serial number of the last presented pixmap. */
+static uint32_t present_serial;
+
+extern bool debug_mode;
+
+/*
+ * Checks whether the X server supports the Present extension. If not, frames
+ * are shown by setting them as window background, which is neither synced
+ * to the vertical blank nor tells us when the frame appeared.
+ *
+ */
+void present_init(void) {
+    const xcb_query_extension_reply_t *extreply;
+
+    extreply = xcb_get_extension_data(conn, &xcb_present_id);
+    if (!extreply->present) {
+        DEBUG("Present is not present, showing frames via the window background.\n");
+        return;
+    }
+
+    xcb_generic_error_t *err;
+    xcb_present_query_version_reply_t *present_version;
+    X_ROUND_TRIP("present_query_version",
+                 present_version = xcb_present_query_version_reply(
+                     conn, xcb_present_query_version(conn, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION), &err));
+    if (err != NULL) {
+        DEBUG("Could not query Present version: X11 error code %d\n", err->error_code);
+        free(err);
+        return;
+    }
+    if (present_version == NULL) {
+        DEBUG("Could not query Present version\n");
+        return;
+    }
+
+    DEBUG("Using Present %d.%d\n", present_version->major_version, present_version->minor_version);
+    free(present_version);
+
+    present_opcode = extreply->major_opcode;
+    use_present = true;
+}
+
+/*
+ * Requests the CompleteNotify and IdleNotify events for the given window.
+ *
+ */
+void present_select_window(xcb_window_t window) {
+    if (!use_present)
+        return;
+
+    xcb_present_select_input(conn, xcb_generate_id(conn), window,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+}
+
+/*
+ * Shows the given pixmap in the window at the next vertical blank. Returns
+ * the serial number the Present events about this pixmap will carry.
+ *
+ */
+uint32_t present_window_pixmap(xcb_window_t window, xcb_pixmap_t pixmap) {
+    present_serial++;
+    const xcb_void_cookie_t cookie = xcb_present_pixmap(conn, window, pixmap, present_serial,
+                       XCB_NONE,           /* valid area: everything */
+                       XCB_NONE,           /* update area: everything */
+                       0, 0,               /* offset */
+                       XCB_NONE,           /* target_crtc: let the server pick */
+                       XCB_NONE, XCB_NONE, /* wait_fence, idle_fence */
+                       XCB_PRESENT_OPTION_NONE,
+                       0, 0, 0, /* target_msc, divisor, remainder: next vblank */
+                       0, NULL);
+    xstats_sent(cookie.sequence);
+    return present_serial;
+}
+
+/*
+ * Handles a generic event, if it is a Present event.
+ *
+ */
+void present_handle_event(xcb_generic_event_t *event) {
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
+    if (!use_present || ge->extension != present_opcode)
+        return;
+
+    switch (ge->event_type) {
+        case XCB_PRESENT_COMPLETE_NOTIFY: {
+            xcb_present_complete_notify_event_t *complete = (xcb_present_complete_notify_event_t *)event;
+            if (complete->kind == XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+                frame_presented(complete->window, complete->serial, complete->ust, complete->msc,
+                                complete->mode == XCB_PRESENT_COMPLETE_MODE_SKIP);
+            break;
+        }
+        case XCB_PRESENT_IDLE_NOTIFY: {
+            xcb_present_idle_notify_event_t *idle = (xcb_present_idle_notify_event_t *)event;
+            frame_idle(idle->pixmap);
+            break;
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _PRESENT_H
+#define _PRESENT_H
+
+/* Whether frames are shown using the Present extension. */
+extern bool use_present;
+
+void present_init(void);
+void present_select_window(xcb_window_t window);
+uint32_t present_window_pixmap(xcb_window_t window, xcb_pixmap_t pixmap);
+void present_handle_event(xcb_generic_event_t *event);
+
+#endif
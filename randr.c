@@ -17,6 +17,9 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "randr.h"
+#include "metrics.h"
+#include "trace.h"
+#include "xstats.h"
 
 /* Number of Xinerama screens which are currently present. */
 int xr_screens = 0;
@@ -42,9 +45,10 @@ void randr_init(int *event_base, xcb_window_t root) {
     }
 
     xcb_generic_error_t *err;
-    xcb_randr_query_version_reply_t *randr_version =
-        xcb_randr_query_version_reply(
-            conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION), &err);
+    xcb_randr_query_version_reply_t *randr_version;
+    X_ROUND_TRIP("randr_query_version",
+                 randr_version = xcb_randr_query_version_reply(
+                     conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION), &err));
     if (err != NULL) {
         DEBUG("Could not query RandR version: X11 error code %d\n", err->error_code);
         _xinerama_init();
@@ -80,7 +84,7 @@ void _xinerama_init(void) {
     xcb_xinerama_is_active_reply_t *reply;
 
     cookie = xcb_xinerama_is_active(conn);
-    reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
+    X_ROUND_TRIP("xinerama_is_active", reply = xcb_xinerama_is_active_reply(conn, cookie, NULL));
     if (!reply)
         return;
 
@@ -108,9 +112,10 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
     /* RandR 1.5 available at run-time (supported by the server) */
     DEBUG("Querying monitors using RandR 1.5\n");
     xcb_generic_error_t *err;
-    xcb_randr_get_monitors_reply_t *monitors =
-        xcb_randr_get_monitors_reply(
-            conn, xcb_randr_get_monitors(conn, root, true), &err);
+    xcb_randr_get_monitors_reply_t *monitors;
+    X_ROUND_TRIP("randr_get_monitors",
+                 monitors = xcb_randr_get_monitors_reply(
+                     conn, xcb_randr_get_monitors(conn, root, true), &err));
     if (err != NULL) {
         DEBUG("Could not get RandR monitors: X11 error code %d\n", err->error_code);
         free(err);
@@ -140,9 +145,13 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
         resolutions[screen].y = monitor_info->y;
         resolutions[screen].width = monitor_info->width;
         resolutions[screen].height = monitor_info->height;
-        DEBUG("found RandR monitor: %d x %d at %d x %d\n",
+        resolutions[screen].mm_width = monitor_info->width_in_millimeters;
+        resolutions[screen].mm_height = monitor_info->height_in_millimeters;
+        resolutions[screen].primary = monitor_info->primary;
+        DEBUG("found RandR monitor: %d x %d at %d x %d (%d mm x %d mm)\n",
               monitor_info->width, monitor_info->height,
-              monitor_info->x, monitor_info->y);
+              monitor_info->x, monitor_info->y,
+              monitor_info->width_in_millimeters, monitor_info->height_in_millimeters);
     }
     free(xr_resolutions);
     xr_resolutions = resolutions;
@@ -167,13 +176,27 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
     xcb_randr_get_screen_resources_current_cookie_t rcookie;
     rcookie = xcb_randr_get_screen_resources_current(conn, root);
 
-    xcb_randr_get_screen_resources_current_reply_t *res =
-        xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL);
+    xcb_randr_get_output_primary_cookie_t pcookie;
+    pcookie = xcb_randr_get_output_primary(conn, root);
+
+    xcb_randr_get_screen_resources_current_reply_t *res;
+    X_ROUND_TRIP("randr_get_screen_resources",
+                 res = xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL));
     if (res == NULL) {
         DEBUG("Could not query screen resources.\n");
+        free(xcb_randr_get_output_primary_reply(conn, pcookie, NULL));
         return false;
     }
 
+    xcb_randr_output_t primary = XCB_NONE;
+    xcb_randr_get_output_primary_reply_t *primary_reply;
+    X_ROUND_TRIP("randr_get_output_primary",
+                 primary_reply = xcb_randr_get_output_primary_reply(conn, pcookie, NULL));
+    if (primary_reply != NULL) {
+        primary = primary_reply->output;
+        free(primary_reply);
+    }
+
     /* timestamp of the configuration so that we get consistent replies to all
      * requests (if the configuration changes between our different calls) */
     const xcb_timestamp_t cts = res->config_timestamp;
@@ -201,7 +224,14 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
     for (int i = 0; i < len; i++) {
         xcb_randr_get_output_info_reply_t *output;
 
-        if ((output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL)) == NULL) {
+        /* The requests were sent at once, so only waiting for the first reply
+         * is a round trip: the others arrive before the reply of any request
+         * sent later. */
+        if (i == 0)
+            X_ROUND_TRIP("randr_get_output_info", output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL));
+        else
+            output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL);
+        if (output == NULL) {
             continue;
         }
 
@@ -213,7 +243,8 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
         xcb_randr_get_crtc_info_cookie_t icookie;
         xcb_randr_get_crtc_info_reply_t *crtc;
         icookie = xcb_randr_get_crtc_info(conn, output->crtc, cts);
-        if ((crtc = xcb_randr_get_crtc_info_reply(conn, icookie, NULL)) == NULL) {
+        X_ROUND_TRIP("randr_get_crtc_info", crtc = xcb_randr_get_crtc_info_reply(conn, icookie, NULL));
+        if (crtc == NULL) {
             DEBUG("Skipping output: could not get CRTC (0x%08x)\n", output->crtc);
             free(output);
             continue;
@@ -223,10 +254,14 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
         resolutions[screen].y = crtc->y;
         resolutions[screen].width = crtc->width;
         resolutions[screen].height = crtc->height;
+        resolutions[screen].mm_width = output->mm_width;
+        resolutions[screen].mm_height = output->mm_height;
+        resolutions[screen].primary = (randr_outputs[i] == primary);
 
-        DEBUG("found RandR output: %d x %d at %d x %d\n",
+        DEBUG("found RandR output: %d x %d at %d x %d (%d mm x %d mm)\n",
               crtc->width, crtc->height,
-              crtc->x, crtc->y);
+              crtc->x, crtc->y,
+              output->mm_width, output->mm_height);
 
         screen++;
 
@@ -251,7 +286,7 @@ void _xinerama_query_screens(void) {
     xcb_xinerama_screen_info_t *screen_info;
     xcb_generic_error_t *err;
     cookie = xcb_xinerama_query_screens_unchecked(conn);
-    reply = xcb_xinerama_query_screens_reply(conn, cookie, &err);
+    X_ROUND_TRIP("xinerama_query_screens", reply = xcb_xinerama_query_screens_reply(conn, cookie, &err));
     if (!reply) {
         DEBUG("Couldn't get Xinerama screens: X11 error code %d\n", err->error_code);
         free(err);
@@ -272,6 +307,11 @@ void _xinerama_query_screens(void) {
         resolutions[screen].y = screen_info[screen].y_org;
         resolutions[screen].width = screen_info[screen].width;
         resolutions[screen].height = screen_info[screen].height;
+        /* Xinerama does not know about physical dimensions. */
+        resolutions[screen].mm_width = 0;
+        resolutions[screen].mm_height = 0;
+        /* Xinerama does not know about the primary output either. */
+        resolutions[screen].primary = (screen == 0);
         DEBUG("found Xinerama screen: %d x %d at %d x %d\n",
               screen_info[screen].width, screen_info[screen].height,
               screen_info[screen].x_org, screen_info[screen].y_org);
@@ -285,13 +325,13 @@ void _xinerama_query_screens(void) {
 }
 
 void randr_query(xcb_window_t root) {
-    if (_randr_query_monitors_15(root)) {
-        return;
-    }
+    metrics_count(COUNTER_RANDR_QUERIES, 1);
+    trace_span_t span = trace_begin("randr_query");
 
-    if (_randr_query_outputs_14(root)) {
-        return;
+    if (!_randr_query_monitors_15(root) &&
+        !_randr_query_outputs_14(root)) {
+        _xinerama_query_screens();
     }
 
-    _xinerama_query_screens();
+    trace_end(span);
 }
@@ -1,11 +1,19 @@
 #ifndef _XINERAMA_H
 #define _XINERAMA_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct Rect {
     int16_t x;
     int16_t y;
     uint16_t width;
     uint16_t height;
+    /* Physical size of the output in millimeters, 0 if unknown. */
+    uint32_t mm_width;
+    uint32_t mm_height;
+    /* Whether this is the primary output. */
+    bool primary;
 } Rect;
 
 extern int xr_screens;
@@ -0,0 +1,276 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+#include <ev.h>
+#include <xcb/xcb.h>
+
+#include "i3lock.h"
+#include "replay.h"
+#include "metrics.h"
+#include "unlock_indicator.h"
+
+#define REPLAY_MAGIC "i3lock-replay-1"
+
+/* How long to keep running after the last event was replayed, so that the
+ * frames it caused are accounted for. */
+#define REPLAY_TAIL 1.0
+
+/* Paths given by --record and --replay, or NULL. */
+char *record_path = NULL;
+char *replay_path = NULL;
+
+extern bool debug_mode;
+
+/* An event, as it was sent by the X server, and when it was processed
+ * relative to the start of recording. */
+typedef struct {
+    uint64_t time_us;
+    uint8_t data[32];
+} replay_record_t;
+
+typedef struct {
+    char magic[16];
+    uint32_t seed;
+    uint32_t reserved;
+} replay_header_t;
+
+static FILE *record_file;
+static uint64_t record_start_us;
+
+static replay_record_t *records;
+static size_t records_len;
+static size_t next_record;
+
+static replay_handler_t replay_handler;
+static uint64_t replay_start_us;
+static struct rusage replay_start_usage;
+static uint64_t replay_start_frames;
+static uint64_t replay_start_dropped;
+#ifdef HAVE_MALLINFO2
+static size_t replay_start_heap;
+#endif
+/* The allocation counter of bench/alloc-count.c, if it is preloaded. */
+static uint64_t (*allocations)(void);
+static uint64_t replay_start_allocations;
+static bool replay_done;
+static ev_timer replay_timer;
+
+static void record_exit(void) {
+    if (record_file != NULL)
+        fclose(record_file);
+    record_file = NULL;
+}
+
+/*
+ * Starts recording the events passed to record_event() to the file given by
+ * --record, together with the seed used for the unlock indicator.
+ *
+ */
+void record_init(uint32_t seed) {
+    if (record_path == NULL)
+        return;
+
+    int fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || (record_file = fdopen(fd, "w")) == NULL)
+        err(EXIT_FAILURE, "Could not open %s", record_path);
+
+    replay_header_t header = {.seed = seed};
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    if (fwrite(&header, sizeof(header), 1, record_file) != 1)
+        err(EXIT_FAILURE, "Could not write %s", record_path);
+    record_start_us = monotonic_us();
+    atexit(record_exit);
+}
+
+/*
+ * Writes out the buffered part of the recording. Called before forking, so
+ * that the buffer is not copied into the child. Whichever process exits
+ * through exit() would otherwise write it to the file a second time.
+ *
+ */
+void record_flush(void) {
+    if (record_file != NULL)
+        fflush(record_file);
+}
+
+/*
+ * Appends the given event to the recording. Written out when the buffer is
+ * full and at exit, so recording does not add I/O to every key press.
+ *
+ */
+void record_event(const xcb_generic_event_t *event) {
+    if (record_file == NULL)
+        return;
+
+    replay_record_t record = {.time_us = monotonic_us() - record_start_us};
+    memcpy(record.data, event, sizeof(record.data));
+    fwrite(&record, sizeof(record), 1, record_file);
+}
+
+/*
+ * Reads the recording given by --replay. Returns the seed it was recorded
+ * with.
+ *
+ */
+uint32_t replay_init(void) {
+    FILE *f = fopen(replay_path, "r");
+    if (f == NULL)
+        err(EXIT_FAILURE, "Could not open %s", replay_path);
+
+    replay_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0)
+        errx(EXIT_FAILURE, "%s is not a recording made with --record", replay_path);
+
+    size_t size = 0;
+    replay_record_t record;
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        if (records_len == size) {
+            size = (size == 0 ? 256 : size * 2);
+            if ((records = realloc(records, size * sizeof(replay_record_t))) == NULL)
+                err(EXIT_FAILURE, "realloc");
+        }
+        records[records_len++] = record;
+    }
+    fclose(f);
+
+    DEBUG("replaying %zu events from %s\n", records_len, replay_path);
+    return header.seed;
+}
+
+static uint64_t timeval_us(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Prints what the replay cost: wall clock and CPU time (of all threads),
+ * frames and, where available, the growth of the heap.
+ *
+ */
+static void print_replay_summary(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    replay_done = true;
+
+    printf("replayed %zu events from %s\n", records_len, replay_path);
+    printf("wall time: %.3f s\n", (monotonic_us() - replay_start_us) / 1000000.0);
+    printf("user time: %.3f s\n", (timeval_us(usage.ru_utime) - timeval_us(replay_start_usage.ru_utime)) / 1000000.0);
+    printf("system time: %.3f s\n", (timeval_us(usage.ru_stime) - timeval_us(replay_start_usage.ru_stime)) / 1000000.0);
+    printf("frames: %llu\n", (unsigned long long)(metrics_value(COUNTER_FRAMES) - replay_start_frames));
+    printf("frames dropped: %llu\n", (unsigned long long)(metrics_value(COUNTER_FRAMES_DROPPED) - replay_start_dropped));
+    printf("authentication attempts: %llu (%llu failed, %llu typed ahead)\n",
+           (unsigned long long)metrics_value(COUNTER_AUTH_ATTEMPTS),
+           (unsigned long long)metrics_value(COUNTER_AUTH_FAILURES),
+           (unsigned long long)metrics_value(COUNTER_AUTH_RETRIES));
+    printf("mean authentication time: %.3f s\n", metrics_mean(HISTOGRAM_AUTH_SECONDS));
+    printf("mean time until verifying was shown: %.3f s\n", metrics_mean(HISTOGRAM_AUTH_VERIFY_SHOWN_SECONDS));
+    printf("mean time until a wrong password was shown: %.3f s\n", metrics_mean(HISTOGRAM_AUTH_WRONG_SHOWN_SECONDS));
+    if (metrics_mean(HISTOGRAM_UNLOCK_SECONDS) > 0)
+        printf("unlocked %.3f s after entering the password, after %zu events\n",
+               metrics_mean(HISTOGRAM_UNLOCK_SECONDS), next_record);
+    printf("worst event loop stall: %.3f ms\n", metrics_gauge(GAUGE_MAX_EVENT_BATCH_SECONDS) * 1000.0);
+    printf("event loop wakeups: %llu\n", (unsigned long long)metrics_wakeups());
+    printf("max rss: %ld KiB\n", usage.ru_maxrss);
+#ifdef HAVE_MALLINFO2
+    printf("heap growth: %zd bytes\n", (ssize_t)(mallinfo2().uordblks - replay_start_heap));
+#endif
+    if (allocations != NULL) {
+        const uint64_t n = allocations() - replay_start_allocations;
+        printf("allocations: %llu (%.2f per event)\n", (unsigned long long)n,
+               (records_len > 0 ? (double)n / records_len : 0.0));
+    }
+    fflush(stdout);
+}
+
+/*
+ * Prints the summary if the replay was cut short by unlocking, which
+ * happens when --pam-service accepts the password.
+ *
+ */
+void finish_replay(void) {
+    if (replay_path != NULL && !replay_done && replay_start_us != 0)
+        print_replay_summary();
+}
+
+/*
+ * Dispatches the events which are due as one batch (see xcb_check_cb() in
+ * i3lock.c), then waits for the next one. After the last one, prints the
+ * summary and ends the event loop.
+ *
+ */
+static void replay_timer_cb(EV_P_ ev_timer *w, int revents) {
+    metrics_wakeup(EV_A_ WAKEUP_REPLAY);
+    if (next_record == records_len) {
+        print_replay_summary();
+        ev_break(EV_A_ EVBREAK_ALL);
+        return;
+    }
+
+    const uint64_t now = monotonic_us() - replay_start_us;
+    int events = 0;
+    begin_redraw_batch();
+    while (events < MAX_EVENTS_PER_BATCH &&
+           next_record < records_len && records[next_record].time_us <= now) {
+        /* The handlers expect a full xcb_generic_event_t. */
+        xcb_generic_event_t event = {0};
+        memcpy(&event, records[next_record].data, sizeof(records[next_record].data));
+        replay_handler(&event);
+        next_record++;
+        events++;
+    }
+    end_redraw_batch(events);
+
+    /* Events which are overdue are dispatched in the next iteration. */
+    double delay = 0.;
+    if (next_record == records_len)
+        delay = REPLAY_TAIL;
+    else if (records[next_record].time_us > now)
+        delay = (records[next_record].time_us - now) / 1000000.0;
+    ev_timer_set(w, delay, 0.);
+    ev_timer_start(EV_A_ w);
+}
+
+/*
+ * Starts feeding the recorded events to the given handler, at the pace they
+ * were recorded at.
+ *
+ */
+void start_replay(struct ev_loop *loop, replay_handler_t handler) {
+    replay_handler = handler;
+    replay_start_us = monotonic_us();
+    getrusage(RUSAGE_SELF, &replay_start_usage);
+    replay_start_frames = metrics_value(COUNTER_FRAMES);
+    replay_start_dropped = metrics_value(COUNTER_FRAMES_DROPPED);
+#ifdef HAVE_MALLINFO2
+    replay_start_heap = mallinfo2().uordblks;
+#endif
+#ifdef HAVE_DLFCN_H
+    allocations = (uint64_t(*)(void))dlsym(RTLD_DEFAULT, "i3lock_allocations");
+    if (allocations != NULL)
+        replay_start_allocations = allocations();
+#endif
+
+    ev_timer_init(&replay_timer, replay_timer_cb, 0., 0.);
+    ev_timer_start(loop, &replay_timer);
+}
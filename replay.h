@@ -0,0 +1,23 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+struct ev_loop;
+
+/* Paths given by --record and --replay, or NULL. */
+extern char *record_path;
+extern char *replay_path;
+
+typedef void (*replay_handler_t)(xcb_generic_event_t *event);
+
+void record_init(uint32_t seed);
+void record_event(const xcb_generic_event_t *event);
+void record_flush(void);
+uint32_t replay_init(void);
+void start_replay(struct ev_loop *loop, replay_handler_t handler);
+void finish_replay(void);
+
+#endif
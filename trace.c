@@ -0,0 +1,96 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#include "trace.h"
+#include "metrics.h"
+
+/* Path given by --trace, or NULL. */
+char *trace_path = NULL;
+
+/* The trace file, -1 if not tracing to a file. */
+static int trace_fd = -1;
+
+/* Small per-thread ids, as pthread_t is opaque. */
+static int next_tid = 1;
+static __thread int trace_tid;
+
+/*
+ * Opens the trace file given by --trace. Spans are written to it as Chrome
+ * trace events (chrome://tracing, Perfetto), one write() per span, so that
+ * the file stays consistent across fork() and several threads.
+ *
+ */
+void trace_init(void) {
+    if (trace_path == NULL)
+        return;
+
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (trace_fd == -1) {
+        warn("Could not open trace file %s", trace_path);
+        return;
+    }
+
+    /* The JSON array format does not require the closing bracket, which is
+     * convenient as i3lock can exit at any point. */
+    const char *header = "[\n";
+    if (write(trace_fd, header, strlen(header)) == -1) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/*
+ * Starts a span of the given name, which must be a string literal. Ended by
+ * trace_end().
+ *
+ * Besides being written to the trace file, spans are available as the SDT
+ * probes i3lock:span_begin and i3lock:span_end (with the name as argument),
+ * e.g. for perf or bpftrace. Those are a nop unless attached to.
+ *
+ */
+trace_span_t trace_begin(const char *name) {
+#ifdef HAVE_SYS_SDT_H
+    DTRACE_PROBE1(i3lock, span_begin, name);
+#endif
+    return (trace_span_t){
+        .name = name,
+        .start_us = (trace_fd == -1 ? 0 : monotonic_us()),
+    };
+}
+
+void trace_end(trace_span_t span) {
+#ifdef HAVE_SYS_SDT_H
+    DTRACE_PROBE1(i3lock, span_end, span.name);
+#endif
+    if (trace_fd == -1)
+        return;
+
+    if (trace_tid == 0)
+        trace_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+
+    char event[256];
+    const uint64_t now = monotonic_us();
+    int len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d},\n",
+                       span.name, (unsigned long long)span.start_us,
+                       (unsigned long long)(now - span.start_us), getpid(), trace_tid);
+    if (len > 0 && len < (int)sizeof(event))
+        (void)!write(trace_fd, event, len);
+}
@@ -0,0 +1,19 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* A span of time spent in one of the hot paths, see trace_begin(). */
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+} trace_span_t;
+
+/* Path given by --trace, or NULL. */
+extern char *trace_path;
+
+void trace_init(void);
+trace_span_t trace_begin(const char *name);
+void trace_end(trace_span_t span);
+
+#endif
@@ -6,6 +6,8 @@
  * See LICENSE for licensing information
  *
  */
+#include <config.h>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -16,12 +18,20 @@
 #include <cairo.h>
 #include <cairo/cairo-xcb.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "i3lock.h"
 #include "xcb.h"
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "present.h"
+#include "metrics.h"
+#include "trace.h"
+#include "font.h"
+#include "dpms.h"
+#include "xstats.h"
 
 #define BUTTON_RADIUS 90
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
@@ -29,11 +39,14 @@
 #define BUTTON_DIAMETER (2 * BUTTON_SPACE)
 #define TIME_FORMAT_12 "%l:%M %p"
 #define TIME_FORMAT_24 "%k:%M"
+/* Upper limit of threads rendering the background concurrently. */
+#define MAX_BACKGROUND_THREADS 16
 
 /*******************************************************************************
  * Variables defined in i3lock.c.
  ******************************************************************************/
-static struct ev_periodic *time_redraw_tick;
+static struct ev_periodic time_redraw_tick;
+static struct ev_loop *time_redraw_loop;
 
 extern bool debug_mode;
 
@@ -51,8 +64,8 @@ extern uint32_t last_resolution[2];
 /* Whether the unlock indicator is enabled (defaults to true). */
 extern bool unlock_indicator;
 
-/* List of pressed modifiers, or NULL if none are pressed. */
-extern char *modifier_string;
+/* List of pressed modifiers, or empty if none are pressed. */
+extern char modifier_string[128];
 
 /* A Cairo surface containing the specified image (-i), if any. */
 extern cairo_surface_t *img;
@@ -60,6 +73,14 @@ extern cairo_surface_t *img;
 /* Whether the image should be tiled. */
 extern bool tile;
 
+/* Whether to use one window per monitor instead of covering the whole root
+ * window with one pixmap. */
+extern bool per_monitor_windows;
+
+/* Whether the X display is remote (e.g. SSH X forwarding or VNC), where every
+ * pixel sent or changed costs bandwidth. */
+extern bool remote_display;
+
 /* The background color to use (in hex). */
 extern char color[7];
 
@@ -81,6 +102,14 @@ extern bool show_failed_attempts;
 /* Number of failed unlock attempts. */
 extern int failed_attempts;
 
+/* How long a frame may take in milliseconds before its quality is reduced,
+ * 0 if unlimited. */
+extern int frame_budget;
+
+/* When the current authentication attempt started, 0 once the user was told
+ * that it failed. */
+extern uint64_t auth_started_us;
+
 /*******************************************************************************
  * Variables defined in xcb.c.
  ******************************************************************************/
@@ -101,266 +130,1598 @@ static xcb_visualtype_t *vistype;
 unlock_state_t unlock_state;
 auth_state_t auth_state;
 
-/*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
- */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-    xcb_pixmap_t bg_pixmap = XCB_NONE;
-    const double scaling_factor = get_dpi_value() / 96.0;
-    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
-    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
-          scaling_factor, button_diameter_physical);
+/* The unlock indicator, drawn once per distinct scaling factor. Screens
+ * with the same DPI share one entry. The surfaces are kept across redraws and
+ * only freed once no screen uses their scaling factor anymore.
+ *
+ * The surfaces live on the X server: cairo draws the indicator into them using
+ * XRender requests, and the X server composites them onto every screen. That
+ * way, a redraw sends requests instead of pixel data and its cost does not
+ * grow with the number of monitors. */
+typedef struct {
+    double scaling_factor;
+    int diameter;
+    cairo_surface_t *surface;
+    /* Kept along with the surface, so that drawing a frame does not allocate
+     * a new context. Only used by the render thread. */
+    cairo_t *ctx;
+    /* Whether the indicator was drawn for the current frame. */
+    bool used;
+} indicator_cache_t;
 
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
-    bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-    /* 
-     * Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. 
-     */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, button_diameter_physical, button_diameter_physical);
-    cairo_t *ctx = cairo_create(output);
+static indicator_cache_t *indicator_cache;
+static int indicator_cache_len;
 
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
+/* When frames repeatedly take longer than frame_budget, their quality is
+ * reduced in these steps, trading the least noticeable detail first. Once
+ * frames are fast again, the quality is restored step by step. */
+typedef enum {
+    QUALITY_FULL = 0,
+    QUALITY_NO_ANTIALIAS = 1, /* draw the indicator without antialiasing */
+    QUALITY_NO_HIGHLIGHT = 2, /* do not highlight a part of the indicator on key presses */
+    QUALITY_PRIMARY_ONLY = 3, /* only draw the indicator on the primary screen */
+} quality_t;
 
-    /* Creates color array from command line arguments */
-    uint32_t * color_array(char* colorarg) {
-        uint32_t *rgb16 = malloc(sizeof(uint32_t)*3);
+static const char *quality_names[] = {
+    "full quality",
+    "no antialiasing",
+    "no key press highlight",
+    "primary screen only",
+};
 
-        char strgroups[3][3] = {{colorarg[0], colorarg[1], '\0'},
-                                {colorarg[2], colorarg[3], '\0'},
-                                {colorarg[4], colorarg[5], '\0'}};
+static quality_t quality = QUALITY_FULL;
 
-        for (int i=0; i < 3; i++) {
-            rgb16[i] = strtol(strgroups[i], NULL, 16);
-        }
+/* Number of consecutive frames over the budget, and below half of it. */
+static int frames_over_budget;
+static int frames_with_headroom;
+
+/* How many consecutive frames over the budget reduce the quality, and how
+ * many fast ones restore it. */
+#define FRAMES_TO_DEGRADE 3
+#define FRAMES_TO_RESTORE 30
+
+/* A snapshot of everything the unlock indicator depends on, taken when a
+ * frame is started, so that it can be drawn while the state changes. */
+typedef struct {
+    unlock_state_t unlock_state;
+    auth_state_t auth_state;
+    /* Empty if no modifiers are pressed. */
+    char modifier_string[128];
+    time_t time;
+    /* The part of the indicator which is highlighted after a key press. It
+     * must be the same on all screens, so it is chosen once per frame. */
+    double highlight_start;
+    quality_t quality;
+} indicator_state_t;
+
+/* The indicators to draw for a frame: the state to draw, and the cache
+ * entries (i.e. scaling factors) used by the frame. */
+typedef struct {
+    indicator_state_t state;
+    indicator_cache_t *entries;
+    int entries_len;
+    int entries_size;
+} render_job_t;
+
+static render_job_t render_job;
+
+/* The unlock indicators are drawn by a render thread, so that handling key
+ * presses never waits for them. The event loop only publishes render_job,
+ * and composites and shows the frame once the render thread is done (see
+ * render_done_cb()). Only one job is rendered at a time; redraws requested
+ * meanwhile are collapsed into one job with the then current state.
+ *
+ * Until start_render_thread() is called (i.e. before i3lock forks), and if
+ * the thread cannot be created, the indicators are drawn synchronously. */
+static bool render_thread_running;
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+/* Protected by render_mutex: whether render_job awaits (or is in) rendering. */
+static bool render_job_queued;
+/* Whether render_job was handed to the render thread and the frame was not
+ * composited yet. Only used by the event loop. */
+static bool render_busy;
+static struct ev_loop *render_loop;
+static ev_async render_done;
+
+/* An X server side surface from which the indicator surfaces are created. */
+static cairo_surface_t *indicator_target;
+
+/* The background (color, image or tiled image) of the whole root window. It
+ * is rendered once into a server-side pixmap, from which the frame buffers
+ * are initialized and the area below the unlock indicators is restored. Only
+ * re-rendered when the resolution changes. */
+static xcb_pixmap_t bg_pixmap = XCB_NONE;
+static uint32_t bg_resolution[2];
+
+/* Two persistent pixmaps, which are used alternately as the background of a
+ * window: a frame is drawn into the one which is currently not shown, which
+ * is then swapped in. They are only reallocated when the size changes, and
+ * each frame only updates the areas of the unlock indicators in place. */
+typedef struct {
+    xcb_pixmap_t pixmap[2];
+    uint32_t size[2];
+    /* Cairo contexts drawing into the pixmaps, created on first use (see
+     * frame_buffer_context()) and kept until the pixmaps are freed. */
+    cairo_t *ctx[2];
+    /* Index of the pixmap shown (or about to be shown), -1 if none. */
+    int current;
+    /* Whether the pixmap was initialized with the background. */
+    bool valid[2];
+    /* With Present: whether the X server may still read from the pixmap,
+     * i.e. it was presented and no IdleNotify has arrived yet. */
+    bool busy[2];
+    /* With Present: the background pixmap of the window, which is shown in
+     * exposed areas until the frame is presented again. */
+    xcb_pixmap_t window_bg;
+} frame_buffers_t;
+
+/* The frame buffers of the lock window. */
+static frame_buffers_t root_frames = {.current = -1};
+
+/* With Present, at most one frame is on its way to the screen at any time:
+ * frames_in_flight is the number of windows for which the CompleteNotify of
+ * the current frame is still outstanding. Redraws requested meanwhile are
+ * collapsed into a single frame (redraw_pending) which is drawn once the
+ * current one got to the screen, so superseded frames are dropped. */
+static int frames_in_flight;
+static bool redraw_pending;
+
+/* The X server does not send the events for frames which never got to an
+ * output (e.g. as its CRTC was turned off or reconfigured meanwhile). So when
+ * the presented frames are not done after this many microseconds, they are
+ * considered lost instead of blocking all further frames. As frames are
+ * shown at the latest at the next vertical blank, this is plenty. */
+#define PRESENT_TIMEOUT_US 1000000
+
+/* When a frame was last presented, in CLOCK_MONOTONIC microseconds. */
+static uint64_t frame_shown_us;
+
+/* When the first redraw which the next frame covers was requested, and the
+ * same for the frame in flight, in CLOCK_MONOTONIC microseconds (which is
+ * what Present timestamps use as well). 0 if none. */
+static uint64_t redraw_requested_us;
+static uint64_t frame_requested_us;
+
+/* While a batch of events is handled (see begin_redraw_batch()), redraws are
+ * only noted, and drawn once at the end of the batch. As unlock_state is
+ * reset right after requesting the redraw for a key press, the frame shows
+ * the unlock_state of the last request (batched_unlock_state), which is
+ * passed to start_frame() instead of the current one. */
+static bool redraw_batching;
+static bool redraw_batched;
+static unlock_state_t batched_unlock_state;
+static uint64_t batch_started_us;
 
-        return rgb16;
+/* When the current frame was started, in CLOCK_MONOTONIC microseconds. */
+static uint64_t frame_started_us;
+
+#ifdef HAVE_XCB_TOTAL_WRITTEN
+/* How many bytes were sent to the X server when the last frame was shown. */
+static uint64_t frame_bytes_written;
+#endif
+
+/* The screen configuration the unlock indicators in root_frames were drawn
+ * for. When it changes, the indicators are at different positions and the
+ * frame buffers need to be reinitialized. */
+static Rect *root_frames_screens;
+static int root_frames_screens_len;
+
+/* With per_monitor_windows, each screen is covered by a child window of the
+ * lock window, and only these windows have background pixmaps, each just as
+ * big as its screen. The remaining area of the (possibly L-shaped) root
+ * window is filled with the background color and needs no pixmap at all. */
+typedef struct {
+    Rect rect;
+    xcb_window_t window;
+    /* The background of this screen, see bg_pixmap. */
+    xcb_pixmap_t bg_pixmap;
+    frame_buffers_t frames;
+} monitor_window_t;
+
+static monitor_window_t *monitor_windows;
+static int monitor_windows_len;
+
+/* Fills the color array from command line arguments */
+static void color_array(const char *colorarg, uint32_t rgb16[3]) {
+    char strgroups[3][3] = {{colorarg[0], colorarg[1], '\0'},
+                            {colorarg[2], colorarg[3], '\0'},
+                            {colorarg[4], colorarg[5], '\0'}};
+
+    for (int i = 0; i < 3; i++) {
+        rgb16[i] = strtol(strgroups[i], NULL, 16);
     }
+}
 
-    /* Sets the color based on argument (color/background, verify, wrong, idle)
-     * and type (line, background and fill). Type defines alpha value and tint.
-     * Utilizes color_array() and frees after use.
-     */
-    void set_color(cairo_t *cr, char *colorarg, char colortype) {
-        uint32_t *rgb16 = color_array(colorarg);
+/* Sets the color based on argument (color/background, verify, wrong, idle)
+ * and type (line, background and fill). Type defines alpha value and tint.
+ * Utilizes color_array() on the stack, as this is called several times for
+ * every frame.
+ */
+static void set_color(cairo_t *cr, char *colorarg, char colortype) {
+    uint32_t rgb16[3];
+    color_array(colorarg, rgb16);
 
-        switch(colortype) {
-            case 'b': /* Background */
-                cairo_set_source_rgb(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-                break;
-            case 'l': /* Line and text */
-                cairo_set_source_rgba(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0, 0.8);
-                break;
-            case 'f': /* Fill */
-                /* Use a lighter tint of the user defined color for circle fill */
-                for (int i=0; i < 3; i++) {
-                    rgb16[i] = ((255 - rgb16[i]) * .5) + rgb16[i];
-                }
-                cairo_set_source_rgba(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0, 0.2);
-                break;
-        }
-        free(rgb16);
+    switch (colortype) {
+        case 'b': /* Background */
+            cairo_set_source_rgb(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
+            break;
+        case 'l': /* Line and text */
+            cairo_set_source_rgba(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0, 0.8);
+            break;
+        case 'f': /* Fill */
+            /* Use a lighter tint of the user defined color for circle fill */
+            for (int i = 0; i < 3; i++) {
+                rgb16[i] = ((255 - rgb16[i]) * .5) + rgb16[i];
+            }
+            cairo_set_source_rgba(cr, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0, 0.2);
+            break;
     }
+}
 
-    if (img) {
-        if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
-        } else {
-            /* create a pattern and fill a rectangle as big as the screen */
-            cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
-            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
-            cairo_pattern_destroy(pattern);
-        }
-    } else {
-        set_color(xcb_ctx,color,'b'); /* If not image, use color to fill background */
-        cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-        cairo_fill(xcb_ctx);
+/* Use the appropriate color for the different PAM states
+ * (currently verifying, wrong password, or idle)
+ */
+static void set_auth_color(cairo_t *ctx, char colortype, const indicator_state_t *state) {
+    switch (state->auth_state) {
+        case STATE_AUTH_VERIFY:
+            set_color(ctx, verifycolor, colortype);
+            break;
+        case STATE_AUTH_LOCK:
+            set_color(ctx, idlecolor, colortype);
+            break;
+        case STATE_AUTH_WRONG:
+            set_color(ctx, wrongcolor, colortype);
+            break;
+        case STATE_I3LOCK_LOCK_FAILED:
+            set_color(ctx, wrongcolor, colortype);
+            break;
+        case STATE_AUTH_SLOW:
+            /* Filled like verifying, as the password might still be right,
+             * but outlined like a wrong one. */
+            set_color(ctx, colortype == 'f' ? verifycolor : wrongcolor, colortype);
+            break;
+        case STATE_AUTH_IDLE:
+            if (state->unlock_state == STATE_BACKSPACE_ACTIVE) {
+                set_color(ctx, wrongcolor, colortype);
+            } else {
+                set_color(ctx, idlecolor, colortype);
+            }
+            break;
     }
+}
 
-    if (unlock_indicator) {
-        cairo_scale(ctx, scaling_factor, scaling_factor);
-        /* Draw a (centered) circle with transparent background. */
-        cairo_set_line_width(ctx, 3.0);
+/*
+ * Computes the extents of the given text at the given font size, in the
+ * embedded font with --builtin-font, see font.c.
+ */
+static void text_extents(cairo_t *ctx, const char *text, double size, cairo_text_extents_t *extents) {
+    if (builtin_font) {
+        builtin_font_text_extents(text, size, extents);
+        return;
+    }
+    cairo_set_font_size(ctx, size);
+    cairo_text_extents(ctx, text, extents);
+}
+
+/*
+ * Draws the given text at the given font size at the current point, in the
+ * embedded font with --builtin-font.
+ */
+static void show_text(cairo_t *ctx, const char *text, double size) {
+    if (builtin_font) {
+        builtin_font_show_text(ctx, text, size);
+        return;
+    }
+    cairo_set_font_size(ctx, size);
+    cairo_show_text(ctx, text);
+}
+
+/*
+ * Draws the unlock indicator for the given state at the given scale onto ctx,
+ * whose target is expected to be transparent and at least BUTTON_DIAMETER *
+ * scaling_factor pixels in size. Only uses the state snapshot, so it is safe
+ * to call from the render thread.
+ */
+static void draw_indicator(cairo_t *ctx, double scaling_factor, const indicator_state_t *state) {
+    cairo_scale(ctx, scaling_factor, scaling_factor);
+    if (state->quality >= QUALITY_NO_ANTIALIAS)
+        cairo_set_antialias(ctx, CAIRO_ANTIALIAS_NONE);
+    /* Draw a (centered) circle with transparent background. */
+    cairo_set_line_width(ctx, 3.0);
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              0 /* start */,
+              2 * M_PI /* end */);
+
+    set_auth_color(ctx, 'f', state);
+    cairo_fill_preserve(ctx);
+
+    /* Circle border */
+    set_auth_color(ctx, 'l', state);
+    cairo_stroke(ctx);
+
+    /* Display (centered) Time */
+    char timetext[16];
+
+    struct tm tm;
+    localtime_r(&state->time, &tm);
+    if (use24hour)
+        strftime(timetext, sizeof(timetext), TIME_FORMAT_24, &tm);
+    else
+        strftime(timetext, sizeof(timetext), TIME_FORMAT_12, &tm);
+
+    /* Text */
+    set_auth_color(ctx, 'l', state);
+
+    cairo_text_extents_t time_extents;
+    double time_x, time_y;
+    //cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+
+    text_extents(ctx, timetext, 32.0, &time_extents);
+    time_x = BUTTON_CENTER - ((time_extents.width / 2) + time_extents.x_bearing);
+    time_y = BUTTON_CENTER - ((time_extents.height / 2) + time_extents.y_bearing);
+
+    cairo_move_to(ctx, time_x, time_y);
+    show_text(ctx, timetext, 32.0);
+    cairo_close_path(ctx);
+
+    const char *subtext = NULL;
+    if (state->auth_state == STATE_AUTH_WRONG && state->modifier_string[0] != '\0')
+        subtext = state->modifier_string;
+    else if (state->auth_state == STATE_AUTH_SLOW)
+        subtext = "Slow, try again";
+
+    if (subtext != NULL) {
+        cairo_text_extents_t extents;
+        double x, y;
+
+        text_extents(ctx, subtext, 14.0, &extents);
+        x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
+        y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + 28.0;
+
+        cairo_move_to(ctx, x, y);
+        show_text(ctx, subtext, 14.0);
+        cairo_close_path(ctx);
+    }
+
+    /* After the user pressed any valid key or the backspace key, we
+     * highlight a random part of the unlock indicator to confirm this
+     * keypress. */
+    if ((state->unlock_state == STATE_KEY_ACTIVE ||
+         state->unlock_state == STATE_BACKSPACE_ACTIVE) &&
+        state->quality < QUALITY_NO_HIGHLIGHT) {
+        cairo_set_line_width(ctx, 4);
+        cairo_new_sub_path(ctx);
         cairo_arc(ctx,
                   BUTTON_CENTER /* x */,
                   BUTTON_CENTER /* y */,
                   BUTTON_RADIUS /* radius */,
-                  0 /* start */,
-                  2 * M_PI /* end */);
-
-        /* Use the appropriate color for the different PAM states
-         * (currently verifying, wrong password, or idle) 
-         */
-
-        void set_auth_color(char colortype) {
-            switch (auth_state) {
-                case STATE_AUTH_VERIFY:
-                    set_color(ctx,verifycolor,colortype);
-                    break;
-                case STATE_AUTH_LOCK:
-                    set_color(ctx,idlecolor,colortype);
-                    break;
-                case STATE_AUTH_WRONG:
-                    set_color(ctx,wrongcolor,colortype);
-                    break;
-                case STATE_I3LOCK_LOCK_FAILED:
-                    set_color(ctx,wrongcolor,colortype);
-                    break;
-                case STATE_AUTH_IDLE:
-                    if (unlock_state == STATE_BACKSPACE_ACTIVE) {
-                        set_color(ctx,wrongcolor,colortype);
-                    }
-                    else {
-                        set_color(ctx,idlecolor,colortype);  
-                    }
-                    break;
-            }
-        }
-
-        set_auth_color('f');
-        cairo_fill_preserve(ctx);
+                  state->highlight_start,
+                  state->highlight_start + (M_PI / 2.5));
 
-        /* Circle border */
-        set_auth_color('l');
+        /* Set newly drawn lines to erase what they're drawn over */
+        cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
         cairo_stroke(ctx);
 
-        /* Display (centered) Time */
-        char *timetext = malloc(6);
+        /* Back to normal operator */
+        cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+        cairo_set_line_width(ctx, 10);
 
-        time_t curtime = time(NULL);
-        struct tm *tm = localtime(&curtime);
-        if (use24hour)
-            strftime(timetext, 100, TIME_FORMAT_24, tm);
-        else
-            strftime(timetext, 100, TIME_FORMAT_12, tm);
+        /* Change color of separators based on backspace/active keypress */
+        set_auth_color(ctx, 'l', state);
+
+        /* Separator 1 */
+        cairo_arc(ctx,
+                  BUTTON_CENTER /* x */,
+                  BUTTON_CENTER /* y */,
+                  BUTTON_RADIUS /* radius */,
+                  state->highlight_start /* start */,
+                  state->highlight_start + (M_PI / 128.0) /* end */);
+        cairo_stroke(ctx);
 
-        /* Text */
-        set_auth_color('l');
-        cairo_set_font_size(ctx, 32.0);
+        /* Separator 2 */
+        cairo_arc(ctx,
+                  BUTTON_CENTER /* x */,
+                  BUTTON_CENTER /* y */,
+                  BUTTON_RADIUS /* radius */,
+                  state->highlight_start + (M_PI / 2.5) /* start */,
+                  (state->highlight_start + (M_PI / 2.5)) + (M_PI / 128.0) /* end */);
+        cairo_stroke(ctx);
+    }
+}
 
-        cairo_text_extents_t time_extents;
-        double time_x, time_y;
-        //cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+/*
+ * Returns the indicator cache entry for the given scaling factor, creating it
+ * (on the X server) if necessary, and marks it as used for the current frame.
+ * The indicator is drawn by render_indicators(). Returns NULL when there is
+ * no memory for a new entry.
+ */
+static indicator_cache_t *get_indicator(double scaling_factor) {
+    indicator_cache_t *entry = NULL;
+    for (int i = 0; i < indicator_cache_len; i++) {
+        if (indicator_cache[i].scaling_factor == scaling_factor) {
+            entry = &indicator_cache[i];
+            break;
+        }
+    }
 
-        cairo_text_extents(ctx, timetext, &time_extents);
-        time_x = BUTTON_CENTER - ((time_extents.width / 2) + time_extents.x_bearing);
-        time_y = BUTTON_CENTER - ((time_extents.height / 2) + time_extents.y_bearing);
+    if (entry == NULL) {
+        indicator_cache_t *cache = realloc(indicator_cache, (indicator_cache_len + 1) * sizeof(indicator_cache_t));
+        if (cache == NULL)
+            return NULL;
+        indicator_cache = cache;
 
-        cairo_move_to(ctx, time_x, time_y);
-        cairo_show_text(ctx, timetext);
-        cairo_close_path(ctx);
+        if (indicator_target == NULL)
+            indicator_target = cairo_xcb_surface_create(conn, screen->root, vistype, 1, 1);
 
-        free(timetext);
+        entry = &indicator_cache[indicator_cache_len++];
+        entry->scaling_factor = scaling_factor;
+        entry->diameter = ceil(scaling_factor * BUTTON_DIAMETER);
+        entry->surface = cairo_surface_create_similar(
+            indicator_target, CAIRO_CONTENT_COLOR_ALPHA, entry->diameter, entry->diameter);
+        entry->ctx = cairo_create(entry->surface);
+        DEBUG("new indicator for scaling_factor %.2f, physical diameter is %d px\n",
+              scaling_factor, entry->diameter);
+    }
 
-        if (auth_state == STATE_AUTH_WRONG && (modifier_string != NULL)) {
-            cairo_text_extents_t extents;
-            double x, y;
+    entry->used = true;
+    return entry;
+}
 
-            cairo_set_font_size(ctx, 14.0);
+/*
+ * Draws the unlock indicators of the given job into their surfaces. This
+ * runs on the render thread, but only issues requests on the X connection
+ * (which, like cairo, is thread-safe), so the event loop can keep
+ * processing events meanwhile.
+ */
+static void render_indicators(const render_job_t *job) {
+    /* The first frame is the one which loads the fonts. */
+    static bool first_rendered = false;
+    const uint64_t start = monotonic_us();
+    trace_span_t span = trace_begin("render_indicators");
 
-            cairo_text_extents(ctx, modifier_string, &extents);
-            x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-            y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + 28.0;
+    for (int i = 0; i < job->entries_len; i++) {
+        const indicator_cache_t *entry = &job->entries[i];
+        cairo_t *ctx = entry->ctx;
+        /* Undo everything the previous frame changed in the context. */
+        cairo_save(ctx);
+        cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(ctx);
+        cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+        draw_indicator(ctx, entry->scaling_factor, &job->state);
+        cairo_new_path(ctx);
+        cairo_restore(ctx);
+        cairo_surface_flush(entry->surface);
+    }
+
+    DEBUG("rendered %d unlock indicator(s) in %.3f ms\n", job->entries_len,
+          (monotonic_us() - start) / 1000.0);
+    metrics_observe_since(HISTOGRAM_RENDER_SECONDS, start);
+    if (!first_rendered && job->entries_len > 0) {
+        first_rendered = true;
+        metrics_gauge_set(GAUGE_FIRST_RENDER_SECONDS, (monotonic_us() - start) / 1000000.0);
+    }
+    trace_end(span);
+}
 
-            cairo_move_to(ctx, x, y);
-            cairo_show_text(ctx, modifier_string);
-            cairo_close_path(ctx);
+/*
+ * Frees the indicator cache entries which are not used for the current frame.
+ */
+static void expire_indicators(void) {
+    int kept = 0;
+    for (int i = 0; i < indicator_cache_len; i++) {
+        if (!indicator_cache[i].used) {
+            DEBUG("dropping indicator for scaling_factor %.2f\n", indicator_cache[i].scaling_factor);
+            cairo_destroy(indicator_cache[i].ctx);
+            cairo_surface_destroy(indicator_cache[i].surface);
+            continue;
         }
+        indicator_cache[i].used = false;
+        indicator_cache[kept++] = indicator_cache[i];
+    }
+    indicator_cache_len = kept;
+}
+
+/*
+ * Returns the scaling factor of the unlock indicator for the given screen
+ * (index into xr_resolutions), or for the root window if screen is -1.
+ */
+static double get_scaling_factor(int screen) {
+    if (screen < 0)
+        return get_dpi_value() / 96.0;
+    return get_output_dpi(&xr_resolutions[screen]) / 96.0;
+}
+
+/*
+ * Whether the unlock indicator is drawn on the given screen (index into
+ * xr_resolutions) at the current quality.
+ */
+static bool indicator_on_screen(int screen) {
+    if (quality < QUALITY_PRIMARY_ONLY)
+        return true;
+
+    bool has_primary = false;
+    for (int i = 0; i < xr_screens; i++)
+        has_primary |= xr_resolutions[i].primary;
+    return (has_primary ? xr_resolutions[screen].primary : screen == 0);
+}
+
+/*
+ * Composites the indicator at the given scale centered onto the given area of
+ * xcb_output, whose drawable is given in drawable. This is a single
+ * RenderComposite request. Only the indicators of render_job (which
+ * render_indicators() drew) are used; a missing one is left out.
+ *
+ * Before, the background below the indicator is restored so that the previous
+ * indicator does not shine through: from bg if given, otherwise drawable is
+ * a window and its own background is used.
+ */
+static void composite_indicator(cairo_t *xcb_ctx, xcb_drawable_t drawable, xcb_pixmap_t bg, double scaling_factor, int x, int y, int width, int height) {
+    const indicator_cache_t *indicator = NULL;
+    for (int i = 0; i < render_job.entries_len && indicator == NULL; i++)
+        if (render_job.entries[i].scaling_factor == scaling_factor)
+            indicator = &render_job.entries[i];
+    if (indicator == NULL) {
+        /* The screens changed since prepare_frame(), so this indicator was
+         * not rendered. The next frame draws it. */
+        DEBUG("no indicator rendered for scaling_factor %.2f, redrawing\n", scaling_factor);
+        if (redraw_requested_us == 0)
+            redraw_requested_us = monotonic_us();
+        redraw_pending = true;
+        return;
+    }
+
+    const int diameter = indicator->diameter;
+    x += (width / 2) - (diameter / 2);
+    y += (height / 2) - (diameter / 2);
+    if (bg == XCB_NONE)
+        xcb_clear_area(conn, 0, drawable, x, y, diameter, diameter);
+    else
+        copy_pixmap_area(conn, screen, bg, drawable, x, y, diameter, diameter);
+    cairo_set_source_surface(xcb_ctx, indicator->surface, x, y);
+    cairo_rectangle(xcb_ctx, x, y, diameter, diameter);
+    cairo_fill(xcb_ctx);
+}
+
+/*
+ * Whether the background is a tiled image which the X server tiles natively:
+ * the window background then is the (small) tile itself, and the unlock
+ * indicators are drawn directly onto the window instead of into a pixmap as
+ * big as the root window.
+ */
+static bool tile_natively(void) {
+    return (img != NULL && tile);
+}
+
+/*
+ * Whether the unlock indicators are drawn directly onto the lock window, whose
+ * background is bg_pixmap, instead of into frame buffers which are then shown
+ * as a whole. Done when tiling natively, and on remote displays: there, each
+ * redraw then only sends (and makes VNC re-encode) the areas of the unlock
+ * indicators.
+ */
+static bool draw_on_window(void) {
+    return (tile_natively() || remote_display);
+}
+
+/*
+ * Whether each screen has its own window, see monitor_window_t. Drawing onto
+ * the lock window takes precedence, as it needs even less memory and
+ * bandwidth.
+ */
+static bool use_monitor_windows(void) {
+    return (per_monitor_windows && !draw_on_window() && xr_screens > 0);
+}
+
+/*
+ * Logs how much X server memory the pixmaps used for drawing take up.
+ */
+static void log_pixmap_memory(void) {
+    if (!debug_mode)
+        return;
 
-        /* After the user pressed any valid key or the backspace key, we
-         * highlight a random part of the unlock indicator to confirm this
-         * keypress. */
-        if (unlock_state == STATE_KEY_ACTIVE ||
-            unlock_state == STATE_BACKSPACE_ACTIVE) {
-            cairo_set_line_width(ctx, 4);
-            cairo_new_sub_path(ctx);
-            double highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
-            cairo_arc(ctx,
-                      BUTTON_CENTER /* x */,
-                      BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */,
-                      highlight_start,
-                      highlight_start + (M_PI / 2.5)); 
-
-            /* Set newly drawn lines to erase what they're drawn over */
-            cairo_set_operator(ctx,CAIRO_OPERATOR_CLEAR); 
-            cairo_stroke(ctx);
-
-            /* Back to normal operator */
-            cairo_set_operator(ctx,CAIRO_OPERATOR_OVER); 
-            cairo_set_line_width(ctx, 10);
-
-            /* Change color of separators based on backspace/active keypress */
-            set_auth_color('l');
-
-            /* Separator 1 */
-            cairo_arc(ctx,
-                BUTTON_CENTER /* x */,
-                BUTTON_CENTER /* y */,
-                BUTTON_RADIUS /* radius */,
-                highlight_start /* start */,
-                highlight_start + (M_PI / 128.0) /* end */);
-            cairo_stroke(ctx);
-
-            /* Separator 2 */
-            cairo_arc(ctx,
-                BUTTON_CENTER /* x */,
-                BUTTON_CENTER /* y */,
-                BUTTON_RADIUS /* radius */,
-                highlight_start + (M_PI / 2.5) /* start */,
-                (highlight_start + (M_PI / 2.5)) + (M_PI / 128.0) /* end */);
-            cairo_stroke(ctx);
+    size_t bytes = 0;
+    if (bg_pixmap != XCB_NONE)
+        bytes += get_pixmap_bytes(conn, screen->root_depth, bg_resolution[0], bg_resolution[1]);
+    if (root_frames.pixmap[0] != XCB_NONE)
+        bytes += 2 * get_pixmap_bytes(conn, screen->root_depth, root_frames.size[0], root_frames.size[1]);
+    for (int i = 0; i < monitor_windows_len; i++) {
+        const Rect *rect = &monitor_windows[i].rect;
+        bytes += 3 * get_pixmap_bytes(conn, screen->root_depth, rect->width, rect->height);
+    }
+    for (int i = 0; i < indicator_cache_len; i++)
+        bytes += get_pixmap_bytes(conn, 32, indicator_cache[i].diameter, indicator_cache[i].diameter);
+    DEBUG("X server pixmap memory: %zu bytes\n", bytes);
+}
+
+/*
+ * Makes sure the frame buffers have the given size. Returns true if they
+ * were (re-)allocated.
+ */
+static bool resize_frame_buffers(frame_buffers_t *frames, uint32_t width, uint32_t height) {
+    if (frames->pixmap[0] != XCB_NONE &&
+        frames->size[0] == width &&
+        frames->size[1] == height)
+        return false;
+
+    for (int i = 0; i < 2; i++) {
+        if (frames->ctx[i] != NULL)
+            cairo_destroy(frames->ctx[i]);
+        frames->ctx[i] = NULL;
+        if (frames->pixmap[i] != XCB_NONE)
+            xcb_free_pixmap(conn, frames->pixmap[i]);
+        frames->pixmap[i] = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, screen->root_depth, frames->pixmap[i], screen->root, width, height);
+        frames->valid[i] = false;
+        frames->busy[i] = false;
+    }
+    frames->size[0] = width;
+    frames->size[1] = height;
+    frames->current = -1;
+    return true;
+}
+
+/*
+ * Frees the frame buffers. The window using one of them as background keeps
+ * it alive on the X server until it gets a new background.
+ */
+static void free_frame_buffers(frame_buffers_t *frames) {
+    for (int i = 0; i < 2; i++) {
+        if (frames->ctx[i] != NULL)
+            cairo_destroy(frames->ctx[i]);
+        frames->ctx[i] = NULL;
+        if (frames->pixmap[i] != XCB_NONE)
+            xcb_free_pixmap(conn, frames->pixmap[i]);
+        frames->pixmap[i] = XCB_NONE;
+        frames->valid[i] = false;
+        frames->busy[i] = false;
+    }
+    frames->current = -1;
+    frames->window_bg = XCB_NONE;
+}
+
+/*
+ * Returns whether the given screens are the same. Compared field by field,
+ * because the padding of Rect is not initialized (see randr.c).
+ */
+static bool same_screens(const Rect *a, const Rect *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i].x != b[i].x || a[i].y != b[i].y ||
+            a[i].width != b[i].width || a[i].height != b[i].height ||
+            a[i].mm_width != b[i].mm_width || a[i].mm_height != b[i].mm_height ||
+            a[i].primary != b[i].primary)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Remembers the current screen configuration for root_frames and returns
+ * true if it differs from the previous one.
+ */
+static bool update_root_frames_screens(void) {
+    if (root_frames_screens_len == xr_screens &&
+        same_screens(root_frames_screens, xr_resolutions, xr_screens))
+        return false;
+
+    free(root_frames_screens);
+    root_frames_screens = NULL;
+    root_frames_screens_len = 0;
+    if (xr_screens > 0 && (root_frames_screens = malloc(xr_screens * sizeof(Rect))) != NULL) {
+        memcpy(root_frames_screens, xr_resolutions, xr_screens * sizeof(Rect));
+        root_frames_screens_len = xr_screens;
+    }
+    return true;
+}
+
+/*
+ * Swaps the frame buffers and returns the one to draw the next frame into,
+ * which the caller must show (see show_frame_buffer()) once it is drawn. It
+ * is initialized with the given background if it does not contain it yet;
+ * otherwise, only the areas of the unlock indicators need to be redrawn.
+ */
+static xcb_pixmap_t next_frame_buffer(frame_buffers_t *frames, xcb_pixmap_t bg) {
+    frames->current = (frames->current + 1) % 2;
+    if (!frames->valid[frames->current]) {
+        copy_pixmap_area(conn, screen, bg, frames->pixmap[frames->current], 0, 0, frames->size[0], frames->size[1]);
+        frames->valid[frames->current] = true;
+    }
+    return frames->pixmap[frames->current];
+}
+
+/*
+ * Returns a cairo context drawing into the frame buffer returned by
+ * next_frame_buffer(). Creating one per frame would allocate (on the client
+ * and the X server) for every key press.
+ */
+static cairo_t *frame_buffer_context(frame_buffers_t *frames) {
+    const int i = frames->current;
+    if (frames->ctx[i] == NULL) {
+        cairo_surface_t *surface = cairo_xcb_surface_create(conn, frames->pixmap[i], vistype, frames->size[0], frames->size[1]);
+        frames->ctx[i] = cairo_create(surface);
+        cairo_surface_destroy(surface);
+    }
+    return frames->ctx[i];
+}
+
+/*
+ * Whether the frame buffer next_frame_buffer() would return can be drawn
+ * into, i.e. the X server no longer reads from it.
+ */
+static bool frame_buffer_ready(const frame_buffers_t *frames) {
+    return !frames->busy[(frames->current + 1) % 2];
+}
+
+/*
+ * Shows the frame buffer returned by next_frame_buffer() in the given window,
+ * whose background is bg. With Present, the frame gets to the screen at the
+ * next vertical blank, and frame_presented() is called once it did.
+ */
+static void show_frame_buffer(frame_buffers_t *frames, xcb_window_t window, xcb_pixmap_t bg) {
+    if (use_present) {
+        if (frames->window_bg != bg) {
+            xcb_change_window_attributes(conn, window, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg});
+            frames->window_bg = bg;
         }
+        present_window_pixmap(window, frames->pixmap[frames->current]);
+        frames->busy[frames->current] = true;
+        frames_in_flight++;
+        frame_shown_us = monotonic_us();
+        return;
+    }
+
+    xcb_change_window_attributes(conn, window, XCB_CW_BACK_PIXMAP, (uint32_t[1]){frames->pixmap[frames->current]});
+    /* XXX: Possible optimization: Only update the area in the middle of the
+     * screen instead of the whole screen. */
+    xstats_sent(xcb_clear_area(conn, 0, window, 0, 0, frames->size[0], frames->size[1]).sequence);
+}
+
+/*
+ * Paints the given area of the root window's background (the fill color and
+ * image, or tiled image) onto ctx at its origin. source must contain the
+ * image.
+ */
+static void paint_background(cairo_t *ctx, cairo_surface_t *source, int x, int y, uint32_t width, uint32_t height) {
+    set_color(ctx, color, 'b');
+    cairo_paint(ctx);
+
+    if (!tile || tile_natively()) {
+        cairo_set_source_surface(ctx, source, -x, -y);
+        cairo_paint(ctx);
+    } else {
+        /* create a pattern and fill a rectangle as big as the screen */
+        cairo_pattern_t *pattern;
+        pattern = cairo_pattern_create_for_surface(source);
+        cairo_translate(ctx, -x, -y);
+        cairo_set_source(ctx, pattern);
+        cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+        cairo_rectangle(ctx, x, y, width, height);
+        cairo_fill(ctx);
+        cairo_pattern_destroy(pattern);
+    }
+}
+
+/* A band of rows of the background, rendered by one thread of
+ * render_background_bands(). */
+typedef struct {
+    unsigned char *data;
+    int stride;
+    /* The area of the root window this band shows. */
+    int x;
+    int y;
+    uint32_t width;
+    uint32_t height;
+} background_band_t;
+
+static void *render_background_band(void *arg) {
+    background_band_t *band = arg;
+
+    /* Each thread uses its own surfaces, as cairo surfaces must not be used
+     * by multiple threads at once. They only share the (read-only) image
+     * data. */
+    cairo_surface_t *source = cairo_image_surface_create_for_data(
+        cairo_image_surface_get_data(img), cairo_image_surface_get_format(img),
+        cairo_image_surface_get_width(img), cairo_image_surface_get_height(img),
+        cairo_image_surface_get_stride(img));
+    cairo_surface_t *output = cairo_image_surface_create_for_data(
+        band->data, CAIRO_FORMAT_RGB24, band->width, band->height, band->stride);
+    cairo_t *ctx = cairo_create(output);
+    paint_background(ctx, source, band->x, band->y, band->width, band->height);
+    cairo_destroy(ctx);
+    cairo_surface_flush(output);
+    cairo_surface_destroy(output);
+    cairo_surface_destroy(source);
+    return NULL;
+}
+
+/*
+ * Renders the given area of the root window's background into a client side
+ * image. The area is split into bands of rows which are rendered concurrently
+ * by one thread per processor, so that compositing the image over the fill
+ * color does not take up one core (or the X server) for hundreds of
+ * milliseconds on big multi-monitor setups. Returns NULL on error.
+ */
+static cairo_surface_t *render_background_bands(int x, int y, uint32_t width, uint32_t height) {
+    struct timespec start;
+    if (debug_mode)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    if (cairo_surface_status(output) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(output);
+        return NULL;
+    }
+    cairo_surface_flush(img);
+
+    /* Bands should be big enough to be worth a thread. */
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_BACKGROUND_THREADS)
+        threads = MAX_BACKGROUND_THREADS;
+    if (threads > (long)height / 64)
+        threads = height / 64;
+    if (threads < 1)
+        threads = 1;
+
+    background_band_t bands[MAX_BACKGROUND_THREADS];
+    pthread_t band_threads[MAX_BACKGROUND_THREADS];
+    bool started[MAX_BACKGROUND_THREADS] = {false};
+    const int stride = cairo_image_surface_get_stride(output);
+    unsigned char *data = cairo_image_surface_get_data(output);
+    uint32_t row = 0;
+    for (long i = 0; i < threads; i++) {
+        const uint32_t rows = (height - row) / (threads - i);
+        bands[i] = (background_band_t){
+            .data = data + row * stride,
+            .stride = stride,
+            .x = x,
+            .y = y + row,
+            .width = width,
+            .height = rows,
+        };
+        row += rows;
+    }
+
+    /* The first band is rendered by this thread. When a thread cannot be
+     * started, its band is rendered by this thread as well. */
+    for (long i = 1; i < threads; i++)
+        started[i] = (pthread_create(&band_threads[i], NULL, render_background_band, &bands[i]) == 0);
+    render_background_band(&bands[0]);
+    for (long i = 1; i < threads; i++) {
+        if (started[i])
+            pthread_join(band_threads[i], NULL);
+        else
+            render_background_band(&bands[i]);
+    }
+    cairo_surface_mark_dirty(output);
+
+    if (debug_mode) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        DEBUG("rendered background in %ld band(s) in %.3f ms\n", threads,
+              (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
     }
+    return output;
+}
+
+/*
+ * Renders the background (image, tiled image or fill color) of the given
+ * area of the root window into a new pixmap of the area's size. The image is
+ * uploaded to the X server only here, not on every redraw: it is composited
+ * over the fill color on the client (see render_background_bands()) and
+ * then sent in one go.
+ */
+static xcb_pixmap_t render_background(int x, int y, uint32_t width, uint32_t height) {
+    uint32_t size[2] = {width, height};
+    const uint64_t start = monotonic_us();
+
+    DEBUG("rendering background for %d x %d at %d x %d\n", width, height, x, y);
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, size, color);
+    if (!img)
+        /* The pixmap already is filled with the background color. */
+        return pixmap;
+
+    trace_span_t span = trace_begin("render_background");
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, pixmap, vistype, width, height);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    /* On remote displays, the image is composited by the X server instead, as
+     * sending the image itself needs at most as much bandwidth. */
+    cairo_surface_t *background = (remote_display ? NULL : render_background_bands(x, y, width, height));
+    if (background != NULL) {
+        cairo_set_operator(xcb_ctx, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface(xcb_ctx, background, 0, 0);
+        cairo_paint(xcb_ctx);
+        cairo_surface_destroy(background);
+    } else {
+        paint_background(xcb_ctx, img, x, y, width, height);
+    }
+
+    cairo_surface_destroy(xcb_output);
+    cairo_destroy(xcb_ctx);
+    metrics_observe_since(HISTOGRAM_BACKGROUND_SECONDS, start);
+    trace_end(span);
+    return pixmap;
+}
 
+/*
+ * Renders the background into bg_pixmap, unless it already holds the
+ * background for the given resolution. When tiling natively, bg_pixmap only
+ * holds the tile. Returns true if the background was (re-)rendered.
+ */
+static bool draw_background(uint32_t *resolution) {
+    uint32_t size[2] = {resolution[0], resolution[1]};
+    if (tile_natively()) {
+        size[0] = cairo_image_surface_get_width(img);
+        size[1] = cairo_image_surface_get_height(img);
+    }
+
+    if (bg_pixmap != XCB_NONE) {
+        if (bg_resolution[0] == size[0] &&
+            bg_resolution[1] == size[1])
+            return false;
+        xcb_free_pixmap(conn, bg_pixmap);
+    }
+
+    bg_pixmap = render_background(0, 0, size[0], size[1]);
+    bg_resolution[0] = size[0];
+    bg_resolution[1] = size[1];
+    return true;
+}
+
+/*
+ * Draws the unlock indicators onto xcb_ctx (whose drawable is given in
+ * drawable), one in the middle of each screen. See composite_indicator() for
+ * bg.
+ */
+static void draw_indicators(cairo_t *xcb_ctx, xcb_drawable_t drawable, xcb_pixmap_t bg) {
+    if (!unlock_indicator)
+        return;
+
+    struct timespec start;
+    if (debug_mode)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* The context is reused for the next frame; restoring it also releases
+     * the indicator surfaces set as source. */
+    cairo_save(xcb_ctx);
     if (xr_screens > 0) {
         /* Composite the unlock indicator in the middle of each screen. */
         for (int screen = 0; screen < xr_screens; screen++) {
-            int x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (button_diameter_physical / 2)));
-            int y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (button_diameter_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, output, x, y);
-            cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-            cairo_fill(xcb_ctx);
+            if (!indicator_on_screen(screen))
+                continue;
+            composite_indicator(xcb_ctx, drawable, bg, get_scaling_factor(screen),
+                                xr_resolutions[screen].x, xr_resolutions[screen].y,
+                                xr_resolutions[screen].width, xr_resolutions[screen].height);
         }
     } else {
         /* We have no information about the screen sizes/positions, so we just
          * place the unlock indicator in the middle of the X root window and
          * hope for the best. */
-        int x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
-        int y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
-        cairo_set_source_surface(xcb_ctx, output, x, y);
-        cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-        cairo_fill(xcb_ctx);
+        composite_indicator(xcb_ctx, drawable, bg, get_scaling_factor(-1),
+                            0, 0, last_resolution[0], last_resolution[1]);
     }
+    cairo_restore(xcb_ctx);
 
-    cairo_surface_destroy(xcb_output);
-    cairo_surface_destroy(output);
-    cairo_destroy(ctx);
-    cairo_destroy(xcb_ctx);
-    return bg_pixmap;
+    if (debug_mode) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        DEBUG("drew the unlock indicator onto %d screen(s) in %.3f ms\n",
+              (xr_screens > 0 ? xr_screens : 1),
+              (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+    }
 }
 
-/* Calls draw_image on a new pixmap and swaps that with the current pixmap */
-void redraw_screen(void) {
-    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, bg_pixmap);
+/*
+ * Destroys all monitor windows and their pixmaps.
+ */
+static void free_monitor_windows(void) {
+    if (monitor_windows_len == 0)
+        return;
+
+    for (int i = 0; i < monitor_windows_len; i++) {
+        xcb_destroy_window(conn, monitor_windows[i].window);
+        xcb_free_pixmap(conn, monitor_windows[i].bg_pixmap);
+        free_frame_buffers(&monitor_windows[i].frames);
+    }
+    free(monitor_windows);
+    monitor_windows = NULL;
+    monitor_windows_len = 0;
+    /* No CompleteNotify will arrive for frames of destroyed windows. */
+    frames_in_flight = 0;
+    log_pixmap_memory();
+}
+
+/*
+ * (Re-)creates the monitor windows, unless they already match the current
+ * screen configuration. Their background pixmaps are set by
+ * redraw_monitor_windows().
+ */
+static void update_monitor_windows(void) {
+    if (monitor_windows_len == xr_screens) {
+        bool changed = false;
+        for (int i = 0; i < xr_screens; i++) {
+            const Rect *a = &monitor_windows[i].rect;
+            const Rect *b = &xr_resolutions[i];
+            if (a->x != b->x || a->y != b->y || a->width != b->width || a->height != b->height) {
+                changed = true;
+                break;
+            }
+        }
+        if (!changed)
+            return;
+    }
+
+    free_monitor_windows();
+    if (xr_screens == 0)
+        return;
+
+    if ((monitor_windows = calloc(xr_screens, sizeof(monitor_window_t))) == NULL)
+        return;
+
+    for (int i = 0; i < xr_screens; i++) {
+        monitor_window_t *mw = &monitor_windows[i];
+        mw->rect = xr_resolutions[i];
+        mw->bg_pixmap = render_background(mw->rect.x, mw->rect.y, mw->rect.width, mw->rect.height);
+        mw->window = open_monitor_window(conn, screen, win, &mw->rect, mw->bg_pixmap);
+        present_select_window(mw->window);
+        mw->frames.current = -1;
+        mw->frames.window_bg = mw->bg_pixmap;
+        resize_frame_buffers(&mw->frames, mw->rect.width, mw->rect.height);
+        monitor_windows_len++;
+    }
+    log_pixmap_memory();
+}
+
+/*
+ * Draws a new frame for each monitor window and swaps it in.
+ */
+static void redraw_monitor_windows(void) {
+    update_monitor_windows();
+
+    for (int i = 0; i < monitor_windows_len; i++) {
+        monitor_window_t *mw = &monitor_windows[i];
+        xcb_pixmap_t frame_pixmap = next_frame_buffer(&mw->frames, mw->bg_pixmap);
+
+        if (unlock_indicator && indicator_on_screen(i)) {
+            cairo_t *xcb_ctx = frame_buffer_context(&mw->frames);
+            cairo_save(xcb_ctx);
+            composite_indicator(xcb_ctx, frame_pixmap, mw->bg_pixmap, get_scaling_factor(i), 0, 0, mw->rect.width, mw->rect.height);
+            cairo_restore(xcb_ctx);
+        }
+
+        show_frame_buffer(&mw->frames, mw->window, mw->bg_pixmap);
+    }
+}
+
+/* State of the random number generator which picks the position of the key
+ * press highlight. Not rand(), so that a replay (see replay.c) draws the same
+ * highlights as the recording did. */
+static uint32_t highlight_random = 1;
+
+void seed_highlight(uint32_t seed) {
+    highlight_random = (seed != 0 ? seed : 1);
+}
+
+/*
+ * Returns the next number of a xorshift32 sequence.
+ */
+static uint32_t next_highlight_random(void) {
+    uint32_t x = highlight_random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (highlight_random = x);
+}
+
+/*
+ * Takes a snapshot of the state for the next frame, showing the given
+ * unlock_state, and sets up render_job with the indicators it uses, one per
+ * distinct scaling factor.
+ */
+static void prepare_frame(unlock_state_t drawn_unlock_state) {
+    const uint64_t start = monotonic_us();
+    trace_span_t span = trace_begin("prepare_frame");
+    indicator_state_t *state = &render_job.state;
+    state->unlock_state = drawn_unlock_state;
+    state->auth_state = auth_state;
+    snprintf(state->modifier_string, sizeof(state->modifier_string), "%s", modifier_string);
+    state->time = time(NULL);
+    state->highlight_start = (next_highlight_random() % (int)(2 * M_PI * 100)) / 100.0;
+    state->quality = quality;
+
+    for (int i = 0; i < indicator_cache_len; i++)
+        indicator_cache[i].used = false;
+    if (unlock_indicator) {
+        if (xr_screens > 0) {
+            for (int screen = 0; screen < xr_screens; screen++)
+                if (indicator_on_screen(screen))
+                    get_indicator(get_scaling_factor(screen));
+        } else {
+            get_indicator(get_scaling_factor(-1));
+        }
+    }
+    expire_indicators();
+
+    if (render_job.entries_size < indicator_cache_len) {
+        indicator_cache_t *entries = realloc(render_job.entries, indicator_cache_len * sizeof(indicator_cache_t));
+        if (entries == NULL) {
+            render_job.entries_len = 0;
+            trace_end(span);
+            return;
+        }
+        render_job.entries = entries;
+        render_job.entries_size = indicator_cache_len;
+    }
+    memcpy(render_job.entries, indicator_cache, indicator_cache_len * sizeof(indicator_cache_t));
+    render_job.entries_len = indicator_cache_len;
+    metrics_observe_since(HISTOGRAM_PREPARE_SECONDS, start);
+    trace_end(span);
+}
+
+/*
+ * Composites the frame for the lock window into the frame buffer which is
+ * currently not shown, and returns it: the background is restored from
+ * bg_pixmap and the unlock indicators (which must have been rendered) are
+ * composited using XRender, so all of this happens on the X server.
+ *
+ * When drawing onto the window, the returned pixmap is the background only
+ * (the tile when tiling natively), and the unlock indicators are drawn onto
+ * the window by finish_frame().
+ */
+static xcb_pixmap_t compose_root_frame(uint32_t *resolution) {
+    bool changed = draw_background(resolution);
+    if (draw_on_window()) {
+        if (changed)
+            log_pixmap_memory();
+        return bg_pixmap;
+    }
+
+    if (resize_frame_buffers(&root_frames, resolution[0], resolution[1]))
+        changed = true;
+    if (changed)
+        log_pixmap_memory();
+    if (update_root_frames_screens())
+        changed = true;
+    if (changed)
+        root_frames.valid[0] = root_frames.valid[1] = false;
+    xcb_pixmap_t frame_pixmap = next_frame_buffer(&root_frames, bg_pixmap);
+
+    /* Composite one or more (depending on the amount of screens) unlock
+     * indicators onto the frame buffer. */
+    draw_indicators(frame_buffer_context(&root_frames), frame_pixmap, bg_pixmap);
+    return frame_pixmap;
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it. The pixmap is owned by unlock_indicator.c and
+ * must not be freed by the caller. See compose_root_frame().
+ *
+ * The unlock indicators are drawn synchronously, as the pixmap is needed
+ * right away. When using monitor windows, XCB_NONE is returned, as the lock
+ * window then only has a background color.
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+    if (use_monitor_windows())
+        return XCB_NONE;
+
+    trace_span_t span = trace_begin("draw_image");
+    prepare_frame(unlock_state);
+    render_indicators(&render_job);
+    xcb_pixmap_t pixmap = compose_root_frame(resolution);
+    trace_end(span);
+    return pixmap;
+}
+
+/*
+ * Whether the previous frame got to the screen and the frame buffers to draw
+ * into are no longer read by the X server.
+ */
+static bool presented_frames_done(void) {
+    if (frames_in_flight > 0)
+        return false;
+    if (draw_on_window())
+        return true;
+    if (use_monitor_windows()) {
+        for (int i = 0; i < monitor_windows_len; i++)
+            if (!frame_buffer_ready(&monitor_windows[i].frames))
+                return false;
+        return true;
+    }
+    return frame_buffer_ready(&root_frames);
+}
+
+/*
+ * Stops waiting for the CompleteNotify and IdleNotify events of the frames
+ * presented so far, as they might never arrive. Called when they did not
+ * within PRESENT_TIMEOUT_US, and when the outputs are turned on again.
+ */
+void forget_frames_in_flight(void) {
+    if (frames_in_flight > 0)
+        DEBUG("giving up waiting for %d presented frame(s)\n", frames_in_flight);
+    frames_in_flight = 0;
+    root_frames.busy[0] = root_frames.busy[1] = false;
+    for (int i = 0; i < monitor_windows_len; i++)
+        monitor_windows[i].frames.busy[0] = monitor_windows[i].frames.busy[1] = false;
+}
+
+/*
+ * Whether a new frame can be presented, see presented_frames_done(). Frames
+ * which were not done within PRESENT_TIMEOUT_US are considered lost.
+ */
+static bool present_ready(void) {
+    if (presented_frames_done())
+        return true;
+    if (monotonic_us() - frame_shown_us < PRESENT_TIMEOUT_US)
+        return false;
+    forget_frames_in_flight();
+    return true;
+}
+
+/*
+ * Whether a new frame can be started.
+ */
+static bool frame_ready(void) {
+    return !render_busy && (!use_present || present_ready());
+}
+
+/*
+ * Called when the frame presented in the given window got to the screen at
+ * the given time (ust, in microseconds) and frame counter (msc), or was
+ * skipped because a newer one replaced it.
+ */
+void frame_presented(xcb_window_t window, uint32_t serial, uint64_t ust, uint64_t msc, bool skipped) {
+    if (frames_in_flight > 0)
+        frames_in_flight--;
+
+    if (frame_requested_us != 0 && ust >= frame_requested_us) {
+        DEBUG("frame %u %s window 0x%08x at msc %llu, %.3f ms after the redraw was requested\n",
+              serial, (skipped ? "skipped on" : "presented on"), window,
+              (unsigned long long)msc, (ust - frame_requested_us) / 1000.0);
+        if (!skipped)
+            metrics_observe(HISTOGRAM_PRESENT_LATENCY_SECONDS, (ust - frame_requested_us) / 1000000.0);
+    }
+
+    if (frames_in_flight == 0 && redraw_pending && frame_ready())
+        redraw_screen();
+}
+
+/*
+ * Called when the X server no longer reads from the given presented pixmap.
+ */
+void frame_idle(xcb_pixmap_t pixmap) {
+    frame_buffers_t *frames = &root_frames;
+    for (int i = -1; i < monitor_windows_len; i++) {
+        if (i >= 0)
+            frames = &monitor_windows[i].frames;
+        for (int j = 0; j < 2; j++)
+            if (frames->pixmap[j] == pixmap)
+                frames->busy[j] = false;
+    }
+
+    if (redraw_pending && frame_ready())
+        redraw_screen();
+}
+
+/*
+ * Changes the quality of the following frames. As the unlock indicators might
+ * no longer be drawn on all screens, the frame buffers are reinitialized
+ * with the background.
+ */
+static void set_quality(quality_t new_quality) {
+    DEBUG("frame budget of %d ms: switching from %s to %s\n", frame_budget,
+          quality_names[quality], quality_names[new_quality]);
+    quality = new_quality;
+
+    root_frames.valid[0] = root_frames.valid[1] = false;
+    for (int i = 0; i < monitor_windows_len; i++)
+        monitor_windows[i].frames.valid[0] = monitor_windows[i].frames.valid[1] = false;
+    if (draw_on_window())
+        xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+}
+
+/*
+ * Checks how long the last frame took against the frame budget, and reduces
+ * the quality when the budget was repeatedly exceeded, or restores it when
+ * there is enough headroom again.
+ */
+static void check_frame_budget(uint64_t frame_us) {
+    if (frame_budget <= 0)
+        return;
+
+    if (frame_us > (uint64_t)frame_budget * 1000) {
+        frames_with_headroom = 0;
+        DEBUG("frame took %.3f ms, exceeding the budget of %d ms\n", frame_us / 1000.0, frame_budget);
+        if (++frames_over_budget >= FRAMES_TO_DEGRADE && quality < QUALITY_PRIMARY_ONLY) {
+            frames_over_budget = 0;
+            set_quality(quality + 1);
+        }
+    } else if (frame_us < (uint64_t)frame_budget * 1000 / 2) {
+        frames_over_budget = 0;
+        if (++frames_with_headroom >= FRAMES_TO_RESTORE && quality > QUALITY_FULL) {
+            frames_with_headroom = 0;
+            set_quality(quality - 1);
+        }
+    } else {
+        frames_over_budget = 0;
+        frames_with_headroom = 0;
+    }
+}
+
+/*
+ * Logs how many bytes were sent to the X server since the last frame was
+ * shown, which includes everything the frame needed. The frame must have been
+ * flushed.
+ */
+static void log_frame_bytes(void) {
+#ifdef HAVE_XCB_TOTAL_WRITTEN
+    const uint64_t written = xcb_total_written(conn);
+    DEBUG("frame sent %llu bytes to the X server\n", (unsigned long long)(written - frame_bytes_written));
+    frame_bytes_written = written;
+#endif
+}
+
+/*
+ * Returns a cairo context drawing onto the lock window (see draw_on_window()),
+ * which is kept as long as the resolution does not change.
+ */
+static cairo_t *window_context(void) {
+    static cairo_t *ctx;
+    static uint32_t ctx_resolution[2];
+
+    if (ctx != NULL &&
+        (ctx_resolution[0] != last_resolution[0] || ctx_resolution[1] != last_resolution[1])) {
+        cairo_destroy(ctx);
+        ctx = NULL;
+    }
+    if (ctx == NULL) {
+        cairo_surface_t *surface = cairo_xcb_surface_create(conn, win, vistype, last_resolution[0], last_resolution[1]);
+        ctx = cairo_create(surface);
+        cairo_surface_destroy(surface);
+        ctx_resolution[0] = last_resolution[0];
+        ctx_resolution[1] = last_resolution[1];
+    }
+    return ctx;
+}
+
+/*
+ * Composites the rendered unlock indicators into the frame and shows it.
+ */
+static void show_frame(void) {
+    if (use_monitor_windows()) {
+        /* Free the root-sized pixmaps in case we used them before, e.g.
+         * while no screen configuration was known. */
+        if (bg_pixmap != XCB_NONE) {
+            xcb_free_pixmap(conn, bg_pixmap);
+            bg_pixmap = XCB_NONE;
+            free_frame_buffers(&root_frames);
+            xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXEL, (uint32_t[1]){get_colorpixel(color)});
+        }
+        redraw_monitor_windows();
+        xcb_flush(conn);
+        return;
+    }
+    free_monitor_windows();
+
+    if (draw_on_window()) {
+        /* The window background already is the background (or the tile), so
+         * only the unlock indicators need to be drawn. */
+        if (draw_background(last_resolution)) {
+            xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
+            xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+        }
+        draw_indicators(window_context(), win, XCB_NONE);
+        xcb_flush(conn);
+        return;
+    }
+
+    compose_root_frame(last_resolution);
+    show_frame_buffer(&root_frames, win, bg_pixmap);
     xcb_flush(conn);
 }
 
+/* The start of the authentication attempt whose verifying state was shown
+ * last, see finish_frame(). */
+static uint64_t verify_shown_us;
+
+/*
+ * Shows the frame whose unlock indicators were rendered, and accounts for it.
+ */
+static void finish_frame(void) {
+    const uint64_t start = monotonic_us();
+    trace_span_t span = trace_begin("show_frame");
+    show_frame();
+    trace_end(span);
+    metrics_observe_since(HISTOGRAM_COMPOSE_SECONDS, start);
+    metrics_observe_since(HISTOGRAM_FRAME_SECONDS, frame_started_us);
+    metrics_count(COUNTER_FRAMES, 1);
+    if (render_job.state.auth_state == STATE_AUTH_VERIFY && auth_started_us != 0 &&
+        verify_shown_us != auth_started_us) {
+        metrics_observe_since(HISTOGRAM_AUTH_VERIFY_SHOWN_SECONDS, auth_started_us);
+        verify_shown_us = auth_started_us;
+    }
+    if (render_job.state.auth_state == STATE_AUTH_WRONG && auth_started_us != 0) {
+        metrics_observe_since(HISTOGRAM_AUTH_WRONG_SHOWN_SECONDS, auth_started_us);
+        auth_started_us = 0;
+    }
+    log_frame_bytes();
+    check_frame_budget(monotonic_us() - frame_started_us);
+}
+
+/*
+ * Called once the render thread finished render_job: shows the frame, and
+ * starts the next one if redraws were requested meanwhile.
+ */
+static void complete_render(void) {
+    if (!render_busy)
+        return;
+    render_busy = false;
+    finish_frame();
+
+    if (redraw_pending && frame_ready())
+        redraw_screen();
+}
+
+static void render_done_cb(struct ev_loop *loop, ev_async *w, int revents) {
+    metrics_wakeup(loop, WAKEUP_RENDER);
+    complete_render();
+}
+
+static void *render_thread_main(void *arg) {
+    pthread_mutex_lock(&render_mutex);
+    while (true) {
+        while (!render_job_queued)
+            pthread_cond_wait(&render_cond, &render_mutex);
+        pthread_mutex_unlock(&render_mutex);
+
+        render_indicators(&render_job);
+
+        pthread_mutex_lock(&render_mutex);
+        render_job_queued = false;
+        pthread_cond_broadcast(&render_cond);
+        ev_async_send(render_loop, &render_done);
+    }
+    return NULL;
+}
+
+/*
+ * Starts the render thread. Must only be called once i3lock will not fork
+ * anymore, as the child process would not have the thread.
+ */
+void start_render_thread(struct ev_loop *loop) {
+    if (render_thread_running)
+        return;
+
+    render_loop = loop;
+    ev_async_init(&render_done, render_done_cb);
+    ev_async_start(loop, &render_done);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, render_thread_main, NULL) != 0) {
+        DEBUG("Could not start the render thread, rendering synchronously.\n");
+        ev_async_stop(loop, &render_done);
+        return;
+    }
+    pthread_detach(thread);
+    render_thread_running = true;
+}
+
+/*
+ * Starts a new frame showing the given unlock_state and the current state
+ * otherwise: the unlock indicators are rendered (by the render thread, if
+ * running) and then shown.
+ */
+static void start_frame(unlock_state_t drawn_unlock_state) {
+    if (dpms_outputs_off()) {
+        /* Nobody would see the frame. A current one is drawn once the
+         * outputs are on again, see dpms.c. */
+        DEBUG("outputs are off, skipping redraw\n");
+        metrics_count(COUNTER_FRAMES_SKIPPED, 1);
+        redraw_requested_us = 0;
+        redraw_pending = false;
+        return;
+    }
+
+    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", drawn_unlock_state, auth_state);
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    if (redraw_requested_us == 0)
+        redraw_requested_us = monotonic_us();
+    if (!frame_ready()) {
+        /* The previous frame is still being rendered or on its way to the
+         * screen. Once it got there, the then current state is drawn,
+         * dropping all frames which would have been superseded in between. */
+        if (redraw_pending) {
+            DEBUG("dropping superseded frame\n");
+            metrics_count(COUNTER_FRAMES_DROPPED, 1);
+        }
+        redraw_pending = true;
+        return;
+    }
+    redraw_pending = false;
+    frame_requested_us = redraw_requested_us;
+    redraw_requested_us = 0;
+
+    frame_started_us = monotonic_us();
+    trace_span_t span = trace_begin("redraw_screen");
+    prepare_frame(drawn_unlock_state);
+    if (!render_thread_running) {
+        render_indicators(&render_job);
+        finish_frame();
+        trace_end(span);
+        return;
+    }
+
+    render_busy = true;
+    pthread_mutex_lock(&render_mutex);
+    render_job_queued = true;
+    pthread_cond_broadcast(&render_cond);
+    pthread_mutex_unlock(&render_mutex);
+    trace_end(span);
+}
+
+/*
+ * Requests a frame for the current state. Within a batch of events, it is
+ * started by end_redraw_batch().
+ */
+void redraw_screen(void) {
+    if (redraw_batching) {
+        if (redraw_requested_us == 0)
+            redraw_requested_us = monotonic_us();
+        redraw_batched = true;
+        batched_unlock_state = unlock_state;
+        return;
+    }
+
+    start_frame(unlock_state);
+}
+
+/*
+ * Called when parts of the lock window were exposed. The X server restores
+ * the window background by itself, so only the unlock indicators need to be
+ * redrawn, and only if they are not part of the background. With Present,
+ * the background is the one without the unlock indicators.
+ */
+void handle_expose(void) {
+    if (draw_on_window() || use_present)
+        redraw_screen();
+}
+
+/*
+ * Starts handling a batch of events: redraw_screen() only takes note of
+ * redraws until end_redraw_batch(), so that e.g. a burst of key presses
+ * results in a single frame instead of one per key.
+ */
+void begin_redraw_batch(void) {
+    redraw_batching = true;
+    batch_started_us = monotonic_us();
+}
+
+/*
+ * Ends the batch of the given number of events and starts the frame for it,
+ * if any redraw was requested. Records how long the event loop was stalled
+ * by the batch.
+ */
+void end_redraw_batch(int events) {
+    redraw_batching = false;
+    if (redraw_batched) {
+        redraw_batched = false;
+        start_frame(batched_unlock_state);
+    }
+
+    if (events > 0) {
+        const double seconds = (monotonic_us() - batch_started_us) / 1000000.0;
+        metrics_observe(HISTOGRAM_EVENT_BATCH_SECONDS, seconds);
+        metrics_gauge_max(GAUGE_MAX_EVENT_BATCH_SECONDS, seconds);
+    }
+}
+
 /* Always show unlock indicator. */
 
 void clear_indicator(void) {
@@ -371,19 +1732,35 @@ void clear_indicator(void) {
 /* Periodic redraw for clock updates - taken from github.com/ravinrabbid/i3lock-clock */
 
 static void time_redraw_cb(struct ev_loop *loop, ev_periodic *w, int revents) {
+    metrics_wakeup(loop, WAKEUP_CLOCK);
+    dpms_refresh();
     redraw_screen();
 }
 
 void start_time_redraw_tick(struct ev_loop* main_loop) {
-    if (time_redraw_tick) {
-        ev_periodic_set(time_redraw_tick, 1.0, 60., 0);
-        ev_periodic_again(main_loop, time_redraw_tick);
-    } else {
-        /* When there is no memory, we just don’t have a timeout. We cannot
-        * exit() here, since that would effectively unlock the screen. */
-        if (!(time_redraw_tick = calloc(sizeof(struct ev_periodic), 1)))
+    time_redraw_loop = main_loop;
+    ev_periodic_init(&time_redraw_tick, time_redraw_cb, 1.0, 60., 0);
+    update_time_redraw_tick();
+}
+
+/*
+ * Only lets the clock tick while it can be seen: not with the unlock
+ * indicator disabled (the clock is part of it), nor while DPMS has turned
+ * the outputs off. Called again whenever the latter changes, so that the
+ * event loop does not wake up for nothing.
+ *
+ */
+void update_time_redraw_tick(void) {
+    if (time_redraw_loop == NULL)
         return;
-        ev_periodic_init(time_redraw_tick,time_redraw_cb, 1.0, 60., 0);
-        ev_periodic_start(main_loop, time_redraw_tick);
-    }
+
+    const bool visible = (unlock_indicator && !dpms_outputs_off());
+    if (visible == ev_is_active(&time_redraw_tick))
+        return;
+
+    DEBUG("%s the clock tick\n", (visible ? "starting" : "stopping"));
+    if (visible)
+        ev_periodic_start(time_redraw_loop, &time_redraw_tick);
+    else
+        ev_periodic_stop(time_redraw_loop, &time_redraw_tick);
 }
@@ -17,11 +17,21 @@ typedef enum {
     STATE_AUTH_LOCK = 2,          /* currently locking the screen */
     STATE_AUTH_WRONG = 3,         /* the password was wrong */
     STATE_I3LOCK_LOCK_FAILED = 4, /* i3lock failed to load */
+    STATE_AUTH_SLOW = 5,          /* the authenticator did not answer in time */
 } auth_state_t;
 
 xcb_pixmap_t draw_image(uint32_t* resolution);
 void redraw_screen(void);
+void begin_redraw_batch(void);
+void end_redraw_batch(int events);
+void handle_expose(void);
+void frame_presented(xcb_window_t window, uint32_t serial, uint64_t ust, uint64_t msc, bool skipped);
+void frame_idle(xcb_pixmap_t pixmap);
+void forget_frames_in_flight(void);
 void start_time_redraw_tick(struct ev_loop* main_loop);
+void update_time_redraw_tick(void);
+void start_render_thread(struct ev_loop* main_loop);
 void clear_indicator(void);
+void seed_highlight(uint32_t seed);
 
 #endif
\ No newline at end of file
@@ -23,6 +23,10 @@
 
 #include "cursors.h"
 #include "unlock_indicator.h"
+#include "randr.h"
+#include "metrics.h"
+#include "trace.h"
+#include "xstats.h"
 
 extern auth_state_t auth_state;
 
@@ -53,7 +57,7 @@ static unsigned char mask_windows_bits[] = {
     0xf7, 0x00, 0xf3, 0x00, 0xe1, 0x01, 0xe0, 0x01, 0xc0, 0x03, 0xc0, 0x03,
     0x80, 0x01};
 
-static uint32_t get_colorpixel(char *hex) {
+uint32_t get_colorpixel(char *hex) {
     char strgroups[3][3] = {{hex[0], hex[1], '\0'},
                             {hex[2], hex[3], '\0'},
                             {hex[4], hex[5], '\0'}};
@@ -103,6 +107,72 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     return bg_pixmap;
 }
 
+/*
+ * Copies the given area from src to the same position in dst. The copy is
+ * done by the X server, so no pixel data is transferred.
+ *
+ */
+void copy_pixmap_area(xcb_connection_t *conn, xcb_screen_t *scr, xcb_pixmap_t src, xcb_drawable_t dst, int16_t x, int16_t y, uint16_t width, uint16_t height) {
+    static xcb_gcontext_t gc = XCB_NONE;
+    if (gc == XCB_NONE) {
+        gc = xcb_generate_id(conn);
+        xcb_create_gc(conn, gc, scr->root, 0, NULL);
+    }
+
+    xcb_copy_area(conn, src, dst, gc, x, y, x, y, width, height);
+}
+
+/*
+ * Returns how many bytes of X server memory a pixmap of the given depth and
+ * size takes up.
+ *
+ */
+size_t get_pixmap_bytes(xcb_connection_t *conn, uint8_t depth, uint32_t width, uint32_t height) {
+    uint8_t bpp = depth;
+    xcb_format_iterator_t iter;
+    for (iter = xcb_setup_pixmap_formats_iterator(xcb_get_setup(conn));
+         iter.rem;
+         xcb_format_next(&iter)) {
+        if (iter.data->depth == depth) {
+            bpp = iter.data->bits_per_pixel;
+            break;
+        }
+    }
+
+    return (size_t)width * height * bpp / 8;
+}
+
+/*
+ * Returns true if the given X display (as in $DISPLAY) is remote, i.e.
+ * reached via TCP (as with SSH X forwarding), or if the X server is Xvnc. On
+ * such displays, every redrawn pixel costs bandwidth.
+ *
+ */
+bool is_remote_display(xcb_connection_t *conn, const char *name) {
+    char *host = NULL;
+    int display, screen;
+    bool remote = false;
+
+    if (xcb_parse_display(name, &host, &display, &screen)) {
+        /* An empty host or "unix" means a local socket. On macOS, the host
+         * is the path of the launchd socket. */
+        remote = (host[0] != '\0' && strcmp(host, "unix") != 0 && host[0] != '/');
+        free(host);
+    }
+    if (remote)
+        return true;
+
+    const char *vnc = "VNC-EXTENSION";
+    xcb_query_extension_reply_t *reply;
+    X_ROUND_TRIP("query_vnc_extension",
+                 reply = xcb_query_extension_reply(conn, xcb_query_extension(conn, strlen(vnc), vnc), NULL));
+    if (reply != NULL) {
+        remote = reply->present;
+        free(reply);
+    }
+    return remote;
+}
+
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
     uint32_t values[3];
@@ -166,7 +236,34 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
     /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    X_ROUND_TRIP("open_fullscreen_window", xcb_aux_sync(conn));
+
+    return win;
+}
+
+/*
+ * Creates and maps a child window of the lock window covering the given
+ * screen, with the given pixmap as background. Events propagate to the lock
+ * window, so no event mask is selected.
+ *
+ */
+xcb_window_t open_monitor_window(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t parent, const Rect *rect, xcb_pixmap_t pixmap) {
+    xcb_window_t win = xcb_generate_id(conn);
+
+    xcb_create_window(conn,
+                      XCB_COPY_FROM_PARENT,
+                      win,    /* the window id */
+                      parent, /* parent == lock window */
+                      rect->x, rect->y,
+                      rect->width,
+                      rect->height, /* dimensions */
+                      0,            /* border = 0, we draw our own */
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      XCB_WINDOW_CLASS_COPY_FROM_PARENT, /* copy visual from parent */
+                      XCB_CW_BACK_PIXMAP,
+                      (uint32_t[]){pixmap});
+
+    xcb_map_window(conn, win);
 
     return win;
 }
@@ -194,7 +291,9 @@ bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
         err(EXIT_FAILURE, "gettimeofday");
     }
 
+    trace_span_t span = trace_begin("grab_pointer_and_keyboard");
     while (tries-- > 0) {
+        metrics_count(COUNTER_GRAB_ATTEMPTS, 1);
         pcookie = xcb_grab_pointer(
             conn,
             false,               /* get all pointer events specified by the following mask */
@@ -206,7 +305,8 @@ bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
             cursor,              /* we change the cursor to whatever the user wanted */
             XCB_CURRENT_TIME);
 
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
+        X_ROUND_TRIP("grab_pointer", preply = xcb_grab_pointer_reply(conn, pcookie, NULL));
+        if (preply &&
             preply->status == XCB_GRAB_STATUS_SUCCESS) {
             free(preply);
             break;
@@ -235,6 +335,7 @@ bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
     }
 
     while (tries-- > 0) {
+        metrics_count(COUNTER_GRAB_ATTEMPTS, 1);
         kcookie = xcb_grab_keyboard(
             conn,
             true,         /* report events */
@@ -243,7 +344,8 @@ bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
             XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
             XCB_GRAB_MODE_ASYNC);
 
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
+        X_ROUND_TRIP("grab_keyboard", kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL));
+        if (kreply &&
             kreply->status == XCB_GRAB_STATUS_SUCCESS) {
             free(kreply);
             break;
@@ -271,6 +373,7 @@ bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
             redrawn = true;
         }
     }
+    trace_end(span);
 
     return (tries > 0);
 }
@@ -345,10 +448,12 @@ void _init_net_active_window(xcb_connection_t *conn) {
         return;
     }
     xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"),
-        &err);
+    xcb_intern_atom_reply_t *atom_reply;
+    X_ROUND_TRIP("intern_atom",
+                 atom_reply = xcb_intern_atom_reply(
+                     conn,
+                     xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"),
+                     &err));
     if (atom_reply == NULL) {
         fprintf(stderr, "X11 Error %d\n", err->error_code);
         free(err);
@@ -363,11 +468,13 @@ xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root
 
     _init_net_active_window(conn);
 
-    xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(
-        conn,
-        xcb_get_property_unchecked(
-            conn, false, root, _NET_ACTIVE_WINDOW, XCB_GET_PROPERTY_TYPE_ANY, 0, 1 /* word */),
-        NULL);
+    xcb_get_property_reply_t *prop_reply;
+    X_ROUND_TRIP("get_active_window",
+                 prop_reply = xcb_get_property_reply(
+                     conn,
+                     xcb_get_property_unchecked(
+                         conn, false, root, _NET_ACTIVE_WINDOW, XCB_GET_PROPERTY_TYPE_ANY, 0, 1 /* word */),
+                     NULL));
     if (prop_reply == NULL) {
         goto out;
     }
@@ -3,12 +3,19 @@
 
 #include <xcb/xcb.h>
 
+struct Rect;
+
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
+uint32_t get_colorpixel(char *hex);
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
+void copy_pixmap_area(xcb_connection_t *conn, xcb_screen_t *scr, xcb_pixmap_t src, xcb_drawable_t dst, int16_t x, int16_t y, uint16_t width, uint16_t height);
+size_t get_pixmap_bytes(xcb_connection_t *conn, uint8_t depth, uint32_t width, uint32_t height);
+bool is_remote_display(xcb_connection_t *conn, const char *name);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
+xcb_window_t open_monitor_window(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t parent, const struct Rect *rect, xcb_pixmap_t pixmap);
 bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root);
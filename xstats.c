@@ -0,0 +1,258 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+#include "i3lock.h"
+#include "xstats.h"
+
+/* The maximum number of call sites which are told apart. Round trips from
+ * further sites are accounted to the last one. */
+#define MAX_SITES 32
+
+extern bool debug_mode;
+extern xcb_connection_t *conn;
+
+static const char *phase_names[PHASES_COUNT] = {
+    [PHASE_STARTUP] = "startup",
+    [PHASE_STEADY] = "steady",
+    [PHASE_UNLOCK] = "unlock",
+};
+
+typedef struct {
+    const char *name;
+    uint64_t round_trips[PHASES_COUNT];
+    uint64_t wait_us[PHASES_COUNT];
+    /* Bytes the round trips had to send before the server could reply, i.e.
+     * the requests buffered up to and including the one waited for. */
+    uint64_t bytes[PHASES_COUNT];
+} site_stats_t;
+
+/* Round trips are only made from the main thread, and the metrics are
+ * printed from it, so no locking is needed. */
+static site_stats_t sites[MAX_SITES];
+static int sites_len;
+
+static phase_t phase = PHASE_STARTUP;
+static bool initialized;
+
+/* Requests and bytes sent in the finished phases, and the counters at the
+ * start of the current one. */
+static uint64_t phase_requests[PHASES_COUNT];
+static uint64_t phase_bytes[PHASES_COUNT];
+static uint32_t start_sequence;
+static uint64_t start_bytes;
+
+/* The sequence number of the last request known to be sent, see
+ * xstats_sent(). */
+static uint32_t last_sequence;
+
+/* The size of a NoOperation request. */
+#define NO_OPERATION_BYTES 4
+
+/*
+ * Learns the current sequence number at a phase boundary. XCB has no way to
+ * query it, so this sends a NoOperation request (which has no reply). It is
+ * not counted, and is the only request xstats sends, so that observing the
+ * counters does not change them.
+ *
+ */
+static void sync_sequence(void) {
+    if (xcb_connection_has_error(conn))
+        return;
+    last_sequence = xcb_no_operation(conn).sequence - 1;
+}
+
+static uint64_t current_bytes(void) {
+#ifdef HAVE_XCB_TOTAL_WRITTEN
+    return xcb_total_written(conn);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Returns the requests and bytes sent in the given phase so far.
+ *
+ */
+static void phase_totals(phase_t p, uint64_t *requests, uint64_t *bytes) {
+    *requests = phase_requests[p];
+    *bytes = phase_bytes[p];
+    if (p == phase && initialized) {
+        /* The NoOperation request which started this phase is not counted,
+         * neither its sequence number nor, once written, its bytes. */
+        *requests += (uint32_t)(last_sequence - start_sequence);
+        const uint64_t written = current_bytes() - start_bytes;
+        *bytes += (written > NO_OPERATION_BYTES ? written - NO_OPERATION_BYTES : 0);
+    }
+}
+
+/*
+ * Logs how many requests, bytes and round trips the current phase took.
+ * Every round trip adds the network latency to the time the phase takes, so
+ * that is what to expect on remote displays.
+ *
+ */
+static void log_phase(void) {
+    if (!debug_mode)
+        return;
+
+    uint64_t requests, bytes, round_trips = 0, wait_us = 0;
+    phase_totals(phase, &requests, &bytes);
+    for (int i = 0; i < sites_len; i++) {
+        round_trips += sites[i].round_trips[phase];
+        wait_us += sites[i].wait_us[phase];
+    }
+
+    DEBUG("X11 %s phase: %llu requests, %llu bytes, %llu round trips, "
+          "%.3f ms waiting for replies (+%llu ms per ms of latency)\n",
+          phase_names[phase], (unsigned long long)requests, (unsigned long long)bytes,
+          (unsigned long long)round_trips, wait_us / 1000.0, (unsigned long long)round_trips);
+    for (int i = 0; i < sites_len; i++) {
+        if (sites[i].round_trips[phase] == 0)
+            continue;
+        DEBUG("    %-28s %4llu round trips, %.3f ms, %llu bytes\n", sites[i].name,
+              (unsigned long long)sites[i].round_trips[phase], sites[i].wait_us[phase] / 1000.0,
+              (unsigned long long)sites[i].bytes[phase]);
+    }
+}
+
+/*
+ * Ends the current phase and starts the given one.
+ *
+ */
+void xstats_set_phase(phase_t new_phase) {
+    if (!initialized || new_phase == phase)
+        return;
+
+    sync_sequence();
+    log_phase();
+    uint64_t requests, bytes;
+    phase_totals(phase, &requests, &bytes);
+    phase_requests[phase] = requests;
+    phase_bytes[phase] = bytes;
+
+    phase = new_phase;
+    start_sequence = last_sequence + 1;
+    last_sequence = start_sequence;
+    start_bytes = current_bytes();
+}
+
+static void xstats_exit(void) {
+    sync_sequence();
+    log_phase();
+}
+
+/*
+ * Starts accounting the requests sent on the (just opened) X connection.
+ *
+ */
+void xstats_init(void) {
+    initialized = true;
+    sync_sequence();
+    start_sequence = last_sequence + 1;
+    last_sequence = start_sequence;
+    start_bytes = 0;
+    atexit(xstats_exit);
+}
+
+/*
+ * Notes the sequence number of a request i3lock sent anyway, e.g. to show a
+ * frame, so that the metrics of the current phase are up to date without
+ * sending a request.
+ *
+ */
+void xstats_sent(uint32_t sequence) {
+    if ((int32_t)(sequence - last_sequence) > 0)
+        last_sequence = sequence;
+}
+
+/*
+ * Returns the number of bytes written to the X connection so far, 0 if
+ * unknown.
+ *
+ */
+uint64_t xstats_written(void) {
+    return current_bytes();
+}
+
+/*
+ * Accounts for a round trip made from the given site which started at
+ * start_us, see X_ROUND_TRIP().
+ *
+ */
+void xstats_round_trip(const char *site, uint64_t start_us, uint64_t start_written) {
+    const uint64_t waited = monotonic_us() - start_us;
+    const uint64_t written = current_bytes() - start_written;
+
+    int i;
+    for (i = 0; i < sites_len; i++)
+        if (sites[i].name == site || strcmp(sites[i].name, site) == 0)
+            break;
+    if (i == sites_len) {
+        if (sites_len == MAX_SITES)
+            i = MAX_SITES - 1;
+        else
+            sites[sites_len++].name = site;
+    }
+
+    sites[i].round_trips[phase]++;
+    sites[i].wait_us[phase] += waited;
+    sites[i].bytes[phase] += written;
+    metrics_observe(HISTOGRAM_X_ROUND_TRIP_SECONDS, waited / 1000000.0);
+}
+
+/*
+ * Writes the X11 request accounting in the OpenMetrics text format, see
+ * print_metrics().
+ *
+ */
+void xstats_print_metrics(FILE *f) {
+    fprintf(f, "# TYPE i3lock_x_requests counter\n");
+    fprintf(f, "# HELP i3lock_x_requests Requests sent to the X server, by phase.\n");
+    for (int p = 0; p < PHASES_COUNT; p++) {
+        uint64_t requests, bytes;
+        phase_totals(p, &requests, &bytes);
+        fprintf(f, "i3lock_x_requests_total{phase=\"%s\"} %llu\n", phase_names[p], (unsigned long long)requests);
+    }
+#ifdef HAVE_XCB_TOTAL_WRITTEN
+    fprintf(f, "# TYPE i3lock_x_bytes counter\n");
+    fprintf(f, "# HELP i3lock_x_bytes Bytes sent to the X server, by phase.\n");
+    for (int p = 0; p < PHASES_COUNT; p++) {
+        uint64_t requests, bytes;
+        phase_totals(p, &requests, &bytes);
+        fprintf(f, "i3lock_x_bytes_total{phase=\"%s\"} %llu\n", phase_names[p], (unsigned long long)bytes);
+    }
+
+    fprintf(f, "# TYPE i3lock_x_round_trip_bytes counter\n");
+    fprintf(f, "# HELP i3lock_x_round_trip_bytes Bytes sent by round trips to the X server before waiting for the reply, by phase and call site.\n");
+    for (int p = 0; p < PHASES_COUNT; p++)
+        for (int i = 0; i < sites_len; i++)
+            fprintf(f, "i3lock_x_round_trip_bytes_total{phase=\"%s\",site=\"%s\"} %llu\n",
+                    phase_names[p], sites[i].name, (unsigned long long)sites[i].bytes[p]);
+#endif
+
+    fprintf(f, "# TYPE i3lock_x_round_trips counter\n");
+    fprintf(f, "# HELP i3lock_x_round_trips Synchronous round trips to the X server, by phase and call site.\n");
+    for (int p = 0; p < PHASES_COUNT; p++)
+        for (int i = 0; i < sites_len; i++)
+            fprintf(f, "i3lock_x_round_trips_total{phase=\"%s\",site=\"%s\"} %llu\n",
+                    phase_names[p], sites[i].name, (unsigned long long)sites[i].round_trips[p]);
+
+    fprintf(f, "# TYPE i3lock_x_round_trip_wait_seconds counter\n");
+    fprintf(f, "# HELP i3lock_x_round_trip_wait_seconds Time spent waiting for replies from the X server, by phase and call site.\n");
+    for (int p = 0; p < PHASES_COUNT; p++)
+        for (int i = 0; i < sites_len; i++)
+            fprintf(f, "i3lock_x_round_trip_wait_seconds_total{phase=\"%s\",site=\"%s\"} %.6f\n",
+                    phase_names[p], sites[i].name, sites[i].wait_us[p] / 1000000.0);
+}
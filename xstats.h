@@ -0,0 +1,40 @@
+#ifndef _XSTATS_H
+#define _XSTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+typedef enum {
+    PHASE_STARTUP = 0,
+    PHASE_STEADY,
+    PHASE_UNLOCK,
+    PHASES_COUNT,
+} phase_t;
+
+/*
+ * Accounts for a synchronous round trip to the X server made by the given
+ * statement, e.g.
+ *
+ *     X_ROUND_TRIP("get_geometry", geom = xcb_get_geometry_reply(conn, geomc, 0));
+ *
+ * site must be a string literal.
+ *
+ */
+#define X_ROUND_TRIP(site, statement)                   \
+    do {                                                \
+        const uint64_t _start = monotonic_us();         \
+        const uint64_t _written = xstats_written();     \
+        statement;                                      \
+        xstats_round_trip(site, _start, _written);      \
+    } while (0)
+
+void xstats_init(void);
+void xstats_set_phase(phase_t phase);
+void xstats_sent(uint32_t sequence);
+uint64_t xstats_written(void);
+void xstats_round_trip(const char *site, uint64_t start_us, uint64_t start_written);
+void xstats_print_metrics(FILE *f);
+
+#endif